@@ -0,0 +1,12 @@
+// For the Keil C51 compiler.
+
+#ifndef __EEPROM_H__
+#define __EEPROM_H__
+
+#define SETTINGSADDR 0xE000                     // sector for the settings that are kept when the power is off
+#define KEYMAPADDR   0xE200                     // sector for the keymap loaded with <ESC><Y>, see wheelwriter.c
+
+unsigned char eeprom_read(unsigned int address);
+void eeprom_write(unsigned int address,unsigned char value);
+void eeprom_erase(unsigned int address);
+#endif
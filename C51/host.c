@@ -0,0 +1,517 @@
+//************************************************************************//
+// Host link protocols layered on UART2.                                  //
+// for the Keil C51 Compiler                                              //
+//                                                                        //
+// Characters from the host normally go straight to print_char_on_WW().   //
+// In framed mode (<ESC><f><1>) they arrive in frames:                    //
+//   <SOH><seq><len><len characters><CRC high byte><CRC low byte>         //
+// seq counts frames from 0 after framed mode is selected, len is 0 to    //
+// MAXFRAME and the CRC is CRC-16/CCITT (polynomial 0x1021, initial value //
+// 0xFFFF) of seq, len and the characters. A frame with the expected seq  //
+// and a good CRC is printed and then acknowledged with <ACK><seq>, so an //
+// ACK means the characters are in the print queue. The host may send up  //
+// to FRAMEWINDOW frames before it waits for an ACK. A bad frame, or one  //
+// after a lost frame, is answered once with <NAK><expected seq> and the  //
+// host resends from there. A frame already printed (its ACK was lost)    //
+// is acknowledged again but not printed twice. <ESC><f><0> inside a      //
+// frame goes back to unframed characters after that frame.               //
+// Framed mode is refused while XON/XOFF handshaking is on, and turning   //
+// XON/XOFF on ends it. seq, len, the CRC and the characters of a frame,  //
+// and the seq after an ACK or NAK, can be 0x11 or 0x13, which would be   //
+// taken for XON or XOFF on the way. Use RTS/CTS with framed mode.        //
+//                                                                        //
+// ENQ asks for a status report, one line of numbers separated by commas: //
+//   <ESC>S<characters waiting>,<milliseconds of printing to do>,         //
+//   <column>,<micro spaces from the left margin>,<micro spaces per       //
+//   character>,<printwheel ID>,<flags>,<receive overflows>,<transmit     //
+//   overflows>,<acknowledge timeouts>,<offline events>,<bad frames><CR>  //
+// flags: 1=printer offline, 2=no printwheel, 4=error, 8=local mode,      //
+// 16=framed mode, 32=compressed input, 64=raw mode, 128=cooked keys.     //
+// Unframed, ENQ is answered ahead of the characters waiting to be        //
+// printed. Framed, ENQ between frames is answered after the frames       //
+// before it have been printed. Either way the report waits until the     //
+// transmit buffer has room for all of it.                                //
+//                                                                        //
+// ETX/ACK pacing (<ESC><a><n><m>): the host sends a block, then ETX,     //
+// then waits for ACK. With ETXPRINTED the ACK is sent once everything    //
+// before the ETX has been printed. With ETXSPOOLED it's sent as soon as  //
+// the ETX is in the receive buffer and there's room for another block.   //
+//                                                                        //
+// Compressed input (<ESC><z><1>) expands each character from the host,   //
+// or from a frame, before it's printed:                                  //
+//   0x00-0x7F      that character                                        //
+//   0x80 <c>       the character c, for c of 0x80-0xFF                   //
+//   0x81-0xBF      the last character again, 1 to 63 times               //
+//   0xC0-0xFF <d>  3 to 66 characters (the low 6 bits plus 3) copied     //
+//                  from d-31 characters back, d is 0x20-0xFF             //
+// Copies come from a window of the last 256 characters, which starts     //
+// out as spaces, and may overlap the characters they make. d is never    //
+// a control character, so XON/XOFF, ENQ and ETX work as before.          //
+// <ESC><z><0> is expanded like any other characters and the characters   //
+// after it are printed as they are.                                      //
+// tools/wwcompress.py compresses text on the host, and                   //
+// tools/test_wwcompress.py checks it against expand() on a PC.           //
+//                                                                        //
+// In raw mode (<ESC><r><1>) the characters, after unframing and          //
+// expanding, are Printer Board commands checked and passed on by         //
+// ww_raw() in wheelwriter.c. ESC between commands leaves raw mode and    //
+// goes on to print_char_on_WW(), so <ESC><r><0> ends it. ENQ and ETX     //
+// are ordinary characters in raw mode, but with XON/XOFF handshaking     //
+// 0x11 and 0x13 are still XON and XOFF, so use RTS/CTS with raw mode.    //
+//                                                                        //
+// Keys typed in line mode go to host_key(). In cooked mode (<ESC><k><1>) //
+// they're printed and kept until C Rtn, which returns the carrier and    //
+// feeds the paper, then the line and CR are sent to the host together.   //
+// Backspace takes the last character off the line and erases it with     //
+// the correction tape. Any other control key ends the line the same      //
+// way, so the host gets it after the characters typed before it. While   //
+// a line is still going to the host the Function Board's acknowledge     //
+// is withheld, so the typist's next keys wait in the Function Board.     //
+// The host should not echo cooked lines.                                 //
+//************************************************************************//
+
+#include "uart2.h"
+#include "ww-uart3.h"
+#include "host.h"
+#include "ww-uart4.h"
+
+#define FALSE 0
+#define TRUE  1
+
+#define SOH 0x01                                // start of a frame
+#define ACK 0x06                                // the frame has been printed
+#define NAK 0x15                                // resend starting with the frame whose seq follows
+#define ENQ 0x05                                // asks for the status report
+#define ETX 0x03                                // ends a block the host wants acknowledged
+#define ESC 0x1B
+#define BS  0x08
+#define CR  0x0D
+
+#define MAXFRAME 128                            // most characters in one frame
+#define FRAMEWINDOW 8                           // most frames the host sends before waiting for an ACK
+
+#define HUNT   0                                // frame receiver states: waiting for SOH
+#define SEQ    1                                // waiting for the sequence number
+#define LEN    2                                // waiting for the length
+#define DATA   3                                // receiving the characters
+#define CRCHI  4                                // waiting for the high byte of the CRC
+#define CRCLO  5                                // waiting for the low byte of the CRC
+
+#define LITERAL    0x80                         // compressed: the next character is printed as it is
+#define COPY       0xC0                         // compressed: 0xC0-0xFF, copy from the window
+#define OFFSETBASE 0x1F                         // compressed: offset character 0x20-0xFF is 1-224 back
+
+#define LINESIZE 128                            // most characters in a cooked line, including the CR
+#define STATUSSIZE 74                           // most characters in a status report: <ESC>S and 12 numbers of up to 5 digits, each with a separator
+
+bit framed = FALSE;                             // set while the host sends frames
+bit nakSent = FALSE;                            // set after a NAK until a good frame arrives
+bit statusOwed = FALSE;                         // a status report is waiting for room in the transmit buffer
+unsigned char frameState = HUNT;
+unsigned char frameSeq;                         // sequence number of the frame being received
+unsigned char frameLen;                         // number of characters in the frame being received
+unsigned char frameCount;                       // number of characters received so far
+unsigned char expectedSeq = 0;                  // sequence number of the next frame to print
+unsigned int frameCRC;                          // CRC calculated as the frame arrives
+unsigned int receivedCRC;                       // CRC sent by the host
+unsigned char xdata frameBuf[MAXFRAME];         // characters of the frame being received
+unsigned int xdata framesGood = 0;              // frames printed
+unsigned int xdata framesBad = 0;               // frames with a bad length or CRC
+unsigned char ackMode = ETXOFF;                 // ETXOFF, ETXPRINTED or ETXSPOOLED
+unsigned int ackBlock = 256;                    // characters in the host's blocks, for ETXSPOOLED
+bit ackPending = FALSE;                         // ETXPRINTED: ETX has been reached, ACK once it's printed
+bit compressed = FALSE;                         // set while characters from the host are compressed
+bit raw = FALSE;                                // set while characters from the host are Printer Board commands
+bit literalNext = FALSE;                        // compressed: LITERAL has been received
+unsigned char copyLength = 0;                   // compressed: characters to copy once the offset arrives
+unsigned char windowIndex;                      // where the next expanded character goes in window[]
+unsigned char xdata window[256];                // the last 256 characters expanded
+bit cooked = FALSE;                             // set while keys are sent to the host a line at a time
+bit lineDone = FALSE;                           // cooked: C Rtn has been typed, the line is going to the host
+unsigned char xdata keyLine[LINESIZE];          // cooked: the line being typed
+unsigned char keyCount = 0;                     // cooked: characters in keyLine[]
+unsigned char keySent;                          // cooked: characters of keyLine[] sent to the host
+
+void print_char_on_WW(unsigned char charToPrint); // defined in main.c
+extern unsigned char column;                    // defined in main.c
+extern unsigned char printWheel;                // defined in main.c
+extern bit localMode;                           // defined in main.c
+extern bit autoLineFeed;                        // defined in main.c
+extern bit errorLED;                            // defined in main.c
+extern bit printwheelPresent;                   // defined in main.c
+extern unsigned char uSpacesPerChar;            // defined in wheelwriter.c
+extern unsigned int uSpaceCount;                // defined in wheelwriter.c
+unsigned int ww_drain_time(void);               // defined in wheelwriter.c
+void ww_flush(void);                            // defined in wheelwriter.c
+void ww_linefeed(void);                         // defined in wheelwriter.c
+char ww_raw(unsigned char c);                   // defined in wheelwriter.c
+void ww_erase_letter(unsigned char letter);     // defined in wheelwriter.c
+extern unsigned int xdata rx2_overflows;        // defined in uart2.c
+extern unsigned int xdata tx2_overflows;        // defined in uart2.c
+extern unsigned int xdata ackTimeouts;          // defined in ww-uart4.c
+extern unsigned int xdata offlineEvents;        // defined in ww-uart4.c
+
+// ---------------------------------------------------------------------------
+// returns the CRC-16/CCITT of "crc" updated with one more byte
+// ---------------------------------------------------------------------------
+static unsigned int crc16(unsigned int crc,unsigned char c) {
+    unsigned char i;
+
+    crc ^= (unsigned int)c<<8;
+    for (i = 0; i < 8; i++) {
+        if (crc & 0x8000)
+            crc = (crc<<1)^0x1021;
+        else
+            crc <<= 1;
+    }
+    return crc;
+}
+
+// ---------------------------------------------------------------------------
+// sends ACK or NAK and a sequence number to the host
+// ---------------------------------------------------------------------------
+static void reply(unsigned char response,unsigned char seq) {
+    putchar2(response);
+    putchar2(seq);
+}
+
+// ---------------------------------------------------------------------------
+// NAK once for a bad or missing frame, then wait for the host to resend
+// ---------------------------------------------------------------------------
+static void resend(void) {
+    if (!nakSent)
+        reply(NAK,expectedSeq);
+    nakSent = TRUE;
+}
+
+// ---------------------------------------------------------------------------
+// tells the UART2 ISR which control characters from the host it should act
+// on. Frames and raw commands may contain any character.
+// ---------------------------------------------------------------------------
+static void link_controls(void) {
+    uart2_etx(!framed && !raw && (ackMode == ETXSPOOLED));
+    uart2_enquiry(!framed && !raw);
+}
+
+// ---------------------------------------------------------------------------
+// prints a character from the host, or in raw mode passes it to the Printer
+// Board
+// ---------------------------------------------------------------------------
+static void output(unsigned char c) {
+    if (raw) {
+        if (ww_raw(c))
+            return;
+        raw = FALSE;                            // ESC between commands leaves raw mode
+        link_controls();
+    }
+    print_char_on_WW(c);
+}
+
+// ---------------------------------------------------------------------------
+// outputs an expanded character and keeps it in the window
+// ---------------------------------------------------------------------------
+static void expanded(unsigned char c) {
+    window[windowIndex++] = c;                  // windowIndex wraps around at 256
+    output(c);
+}
+
+// ---------------------------------------------------------------------------
+// prints the characters from the host, expanding them in compressed mode
+// ---------------------------------------------------------------------------
+static void expand(unsigned char c) {
+    unsigned char n,from;
+
+    if (!compressed)
+        output(c);
+    else if (literalNext) {
+        literalNext = FALSE;
+        expanded(c);
+    }
+    else if (copyLength) {                      // c is the offset of the copy
+        n = copyLength;
+        copyLength = 0;
+        if (c <= OFFSETBASE)                    // not an offset, print it
+            expanded(c);
+        else {
+            from = windowIndex-(c-OFFSETBASE);
+            do
+                expanded(window[from++]);       // may copy characters this copy has made
+            while (--n);
+        }
+    }
+    else if (c < LITERAL)
+        expanded(c);
+    else if (c == LITERAL)
+        literalNext = TRUE;
+    else if (c < COPY) {                        // a run of the last character
+        n = c & 0x3F;
+        do
+            expanded(window[(unsigned char)(windowIndex-1)]);
+        while (--n);
+    }
+    else
+        copyLength = (c & 0x3F)+3;              // wait for the offset
+}
+
+// ---------------------------------------------------------------------------
+// a frame with a good CRC has arrived
+// ---------------------------------------------------------------------------
+static void end_frame(void) {
+    unsigned char i;
+
+    if (frameSeq == expectedSeq) {              // the frame that was expected...
+        for (i = 0; i < frameLen; i++)
+            expand(frameBuf[i]);                // ...goes to the print queue
+        ++framesGood;
+        nakSent = FALSE;
+        reply(ACK,expectedSeq++);               // then it's acknowledged
+    }
+    else if ((unsigned char)(expectedSeq-frameSeq) <= FRAMEWINDOW)
+        reply(ACK,expectedSeq-1);               // already printed, the host missed the ACK
+    else
+        resend();                               // a frame before this one was lost
+}
+
+// ---------------------------------------------------------------------------
+// sends a number in decimal and a separator to the host
+// ---------------------------------------------------------------------------
+static void send_number(unsigned int n,char separator) {
+    unsigned int divisor = 10000;
+
+    while ((divisor > 1) && (divisor > n))      // no leading zeros
+        divisor /= 10;
+    while (divisor) {
+        putchar2('0'+n/divisor);
+        n %= divisor;
+        divisor /= 10;
+    }
+    putchar2(separator);
+}
+
+// ---------------------------------------------------------------------------
+// sends the status report to the host
+// ---------------------------------------------------------------------------
+void host_status(void) {
+    unsigned char flags = 0;
+
+    if (uart2_tx_free() < STATUSSIZE) {
+        statusOwed = TRUE;                      // host_check() sends it once there's room
+        return;
+    }
+    statusOwed = FALSE;
+    if (printer_board_offline()) flags |= 0x01;
+    if (!printwheelPresent) flags |= 0x02;
+    if (errorLED) flags |= 0x04;
+    if (localMode) flags |= 0x08;
+    if (framed) flags |= 0x10;
+    if (compressed) flags |= 0x20;
+    if (raw) flags |= 0x40;
+    if (cooked) flags |= 0x80;
+    putchar2(ESC);
+    putchar2('S');
+    send_number(uart2_waiting(),',');
+    send_number(ww_drain_time(),',');
+    send_number(column,',');
+    send_number(uSpaceCount,',');
+    send_number(uSpacesPerChar,',');
+    send_number(printWheel,',');
+    send_number(flags,',');
+    send_number(rx2_overflows,',');
+    send_number(tx2_overflows,',');
+    send_number(ackTimeouts,',');
+    send_number(offlineEvents,',');
+    send_number(framesBad,CR);
+}
+
+// ---------------------------------------------------------------------------
+// selects ETX/ACK pacing: mode is ETXOFF, ETXPRINTED or ETXSPOOLED and block
+// is the number of characters the host sends before each ETX
+// ---------------------------------------------------------------------------
+void host_etx(unsigned char mode,unsigned int block) {
+    ackMode = mode;
+    ackBlock = block;
+    ackPending = FALSE;
+    link_controls();                            // the UART2 ISR counts ETX as it arrives
+}
+
+// ---------------------------------------------------------------------------
+// called from the main loop. sends ACK for blocks that have been printed
+// or, with ETXSPOOLED, accepted into the receive buffer, and sends cooked
+// lines.
+// ---------------------------------------------------------------------------
+void host_check(void) {
+    if (statusOwed)
+        host_status();                          // a status report that didn't fit before
+    if (ackPending && printer_board_idle() && !ww_drain_time()) {
+        ackPending = FALSE;
+        putchar2(ACK);                          // the block has been printed
+    }
+    if ((ackMode == ETXSPOOLED) && uart2_etx_ack(ackBlock))
+        putchar2(ACK);                          // there's room for the next block
+    while (lineDone && uart2_tx_free()) {       // send the cooked line as there's room for it
+        putchar2(keyLine[keySent++]);
+        if (keySent == keyCount) {
+            lineDone = FALSE;
+            keyCount = 0;
+            function_board_hold(ACKHOLD_LINE,FALSE);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// turns compressed input on (on is 1) or off (on is 0)
+// ---------------------------------------------------------------------------
+void host_compression(char on) {
+    if (on && !compressed) {
+        windowIndex = 0;
+        do
+            window[windowIndex] = ' ';          // copies from before the start are spaces
+        while (++windowIndex);
+        literalNext = FALSE;
+        copyLength = 0;
+    }
+    compressed = on;
+}
+
+// ---------------------------------------------------------------------------
+// turns raw mode on (on is 1) or off (on is 0)
+// ---------------------------------------------------------------------------
+void host_raw(char on) {
+    if (on && !raw)
+        ww_flush();                             // the carrier and paper are where raw mode expects them
+    raw = on;
+    link_controls();
+}
+
+// ---------------------------------------------------------------------------
+// turns cooked keys on (on is 1) or off (on is 0)
+// ---------------------------------------------------------------------------
+void host_cooking(char on) {
+    if (!on && !lineDone)
+        keyCount = 0;                           // a line that's partly typed is dropped
+    cooked = on;
+}
+
+// ---------------------------------------------------------------------------
+// ends the cooked line with "c" and starts sending it to the host
+// ---------------------------------------------------------------------------
+static void key_line_done(unsigned char c) {
+    keyLine[keyCount++] = c;
+    keySent = 0;
+    lineDone = TRUE;                            // host_check() sends the line
+    function_board_hold(ACKHOLD_LINE,TRUE);     // the next keys wait until it's gone
+}
+
+// ---------------------------------------------------------------------------
+// called with each key typed in line mode
+// ---------------------------------------------------------------------------
+void host_key(unsigned char c) {
+    if (!cooked) {
+        putchar2(c);                            // raw keys go straight to the host
+        return;
+    }
+    if (lineDone)
+        return;                                 // a key that arrived before the hold took effect
+    if (c == BS) {
+        if (keyCount) {
+            c = keyLine[--keyCount];
+            if (c == ' ')
+                print_char_on_WW(BS);           // nothing to erase, just back up
+            else {
+                ww_erase_letter(c);             // erase it with the correction tape
+                --column;
+            }
+        }
+    }
+    else if (c == CR) {
+        key_line_done(CR);
+        print_char_on_WW(CR);
+        if (!autoLineFeed)
+            ww_linefeed();                      // the host doesn't echo, so C Rtn feeds the paper here
+        ww_flush();
+    }
+    else if ((c >= 0x20) && (c < 0x7F)) {
+        if (keyCount < LINESIZE-1) {            // room for the character and the CR
+            keyLine[keyCount++] = c;
+            print_char_on_WW(c);
+            ww_flush();                         // the typist expects the printer to follow every key
+        }
+    }
+    else
+        key_line_done(c);                       // other control keys go to the host after the keys typed before them
+}
+
+// ---------------------------------------------------------------------------
+// turns framed mode on (on is 1) or off (on is 0)
+// ---------------------------------------------------------------------------
+void host_framing(char on) {
+    if (on && !framed) {
+        expectedSeq = 0;                        // the first frame is 0
+        frameState = HUNT;
+        nakSent = FALSE;
+    }
+    framed = on;
+    link_controls();                            // framed, ENQ and ETX may be part of a frame
+}
+
+// ---------------------------------------------------------------------------
+// called with each character from the host
+// ---------------------------------------------------------------------------
+void host_receive(unsigned char c) {
+    if (!framed) {
+        if ((c == ETX) && (ackMode == ETXPRINTED) && !raw) {
+            ww_flush();                         // print everything before the ETX...
+            ackPending = TRUE;                  // ...and ACK when it's done
+        }
+        else
+            expand(c);                          // unframed, print the character
+        return;
+    }
+
+    switch (frameState) {
+        case HUNT:
+            if (c == SOH) {
+                frameCRC = 0xFFFF;
+                frameState = SEQ;
+            }
+            else if (c == ENQ)
+                host_status();                  // status request between frames
+            break;
+        case SEQ:
+            frameSeq = c;
+            frameCRC = crc16(frameCRC,c);
+            frameState = LEN;
+            break;
+        case LEN:
+            frameLen = c;
+            frameCRC = crc16(frameCRC,c);
+            frameCount = 0;
+            if (frameLen > MAXFRAME) {          // can't be a frame, look for the next SOH
+                ++framesBad;
+                resend();
+                frameState = HUNT;
+            }
+            else
+                frameState = frameLen ? DATA : CRCHI;
+            break;
+        case DATA:
+            frameBuf[frameCount++] = c;
+            frameCRC = crc16(frameCRC,c);
+            if (frameCount == frameLen)
+                frameState = CRCHI;
+            break;
+        case CRCHI:
+            receivedCRC = (unsigned int)c<<8;
+            frameState = CRCLO;
+            break;
+        case CRCLO:
+            frameState = HUNT;
+            if ((receivedCRC|c) == frameCRC)
+                end_frame();
+            else {
+                ++framesBad;
+                resend();
+            }
+            break;
+    }
+}
@@ -0,0 +1,19 @@
+// For the Keil C51 compiler.
+
+#ifndef __HOST_H__
+#define __HOST_H__
+
+void host_receive(unsigned char c);
+void host_framing(char on);
+void host_status(void);
+void host_etx(unsigned char mode,unsigned int block);
+void host_check(void);
+void host_compression(char on);
+void host_raw(char on);
+void host_cooking(char on);
+void host_key(unsigned char c);
+
+#define ETXOFF     0                            // host_etx() modes: ETX is ignored
+#define ETXPRINTED 1                            // ACK once the block has been printed
+#define ETXSPOOLED 2                            // ACK once the block is in the receive buffer
+#endif
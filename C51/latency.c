@@ -0,0 +1,211 @@
+//************************************************************************//
+// Keystroke latency.                                                     //
+// for the Keil C51 Compiler                                              //
+//                                                                        //
+// Times keys from the Function Board to the Printer Board. Each key is   //
+// stamped four times:                                                    //
+//   key      the UART3 ISR receives the 0x121 that starts its words      //
+//   decoded  ww_decode_keys() returns its character                      //
+//   sent     the first word queued for the Printer Board after that is   //
+//            sent                                                        //
+//   acked    the Printer Board acknowledges that word                    //
+// A stamp is the low byte of the 50 millisecond tick count and the 256   //
+// microsecond steps of timer 0 within the tick, so times are good to     //
+// about a quarter of a millisecond and up to 12.8 seconds.               //
+//                                                                        //
+// One key is timed at a time; keys decoded while it waits to be printed  //
+// are not timed. Relayed keys are not timed. In line mode the first word //
+// after the key is usually the host's echo of it. A key that isn't       //
+// printed within LATENCYTIMEOUT is not counted.                          //
+//                                                                        //
+// <ESC><^Z><k> on the UART1 monitor shows the average times to decoded   //
+// and to sent and the minimum, average, maximum and 50th, 90th and 99th  //
+// percentile times to acked, then starts counting again. Percentiles     //
+// come from a histogram whose counts are halved when one fills, so they  //
+// follow the most recent keys.                                           //
+//************************************************************************//
+
+#include <stdio.h>
+#include <reg51.h>
+#include "stc51.h"
+#include "latency.h"
+
+#define FALSE 0
+#define TRUE  1
+#define LATENCYTIMEOUT 20000                    // tenths of a millisecond before a key that hasn't been printed is dropped
+#define BINS 8                                  // histogram bins
+
+volatile unsigned int xdata keyStamps[KEYSTAMPS]; // stamps of the 0x121s in the UART3 buffer, written by the UART3 ISR
+volatile unsigned char keyStampHead = 0;        // index used by the UART3 ISR to fill keyStamps
+unsigned char keyStampTail = 0;                 // index used to empty keyStamps
+bit keyStampValid = FALSE;                      // keyStamp belongs to the key being decoded
+unsigned int keyStamp;                          // stamp of the 0x121 of the key being decoded
+
+volatile unsigned char latencyStage = LATENCYIDLE; // how far the key being timed has got, see latency.h
+unsigned char latencyWord;                      // Printer Board queue index of the timed key's first word
+volatile unsigned int sentStamp;                // written by the UART4 ISR or start_printer_board_queue()
+volatile unsigned int ackStamp;                 // written by the UART4 ISR
+unsigned int timedStamp;                        // stamp of the 0x121 of the key being timed
+unsigned int decodedTime;                       // tenths of a millisecond from timedStamp to its character
+
+unsigned int xdata latencyCount = 0;          // keys timed
+unsigned int xdata latencyMin = 0xFFFF;       // tenths of a millisecond from key to acked
+unsigned int xdata latencyMax = 0;
+unsigned long xdata latencySum = 0;
+unsigned long xdata decodedSum = 0;           // tenths of a millisecond from key to decoded
+unsigned long xdata sentSum = 0;              // tenths of a millisecond from key to sent
+unsigned char xdata latencyBins[BINS] = {0}; // histogram of the times from key to acked
+
+// the upper limits of the histogram bins in tenths of a millisecond. the last bin holds the rest
+unsigned int code binLimits[BINS-1] = {50,100,200,300,500,1000,2000};
+
+extern volatile unsigned int tickCount;         // defined in main.c
+extern volatile unsigned char tx4_head;         // defined in ww-uart4.c
+
+// ---------------------------------------------------------------------------
+// returns tenths of a millisecond from stamp "from" to stamp "to"
+// ---------------------------------------------------------------------------
+static unsigned int elapsed(unsigned int from,unsigned int to) {
+   long us;
+
+   us = (long)(unsigned char)((to>>8)-(from>>8))*50000L+((int)(to&0xFF)-(int)(from&0xFF))*256L;
+   if (us < 0)                                  // the same tick, or the stamps are out of order
+      return 0;
+   if (us > 6553500L)
+      return 0xFFFF;
+   return us/100;
+}
+
+// ---------------------------------------------------------------------------
+// returns the time now as a latency stamp. interrupts are left as they were
+// found, so it can be called with them disabled.
+// ---------------------------------------------------------------------------
+unsigned int latency_now(void) {
+   unsigned int s;
+   bit ea;
+
+   ea = EA;
+   EA = 0;                                      // keep timer 0 from counting the tick while it's read
+   LATENCY_STAMP(s);
+   EA = ea;
+   return s;
+}
+
+// ---------------------------------------------------------------------------
+// call when 0x121 is read from the Function Board. takes the stamp the UART3
+// ISR made for it, unless the ISR has stamped more keys than keyStamps holds.
+// ---------------------------------------------------------------------------
+void latency_key(void) {
+   unsigned char waiting;
+
+   CLR_ES3;                                     // keep the UART3 ISR out while we look at the stamps
+   waiting = keyStampHead-keyStampTail;
+   keyStampValid = (waiting && (waiting <= KEYSTAMPS));
+   if (keyStampValid)
+      keyStamp = keyStamps[keyStampTail & (KEYSTAMPS-1)];
+   if (waiting)
+      ++keyStampTail;
+   SET_ES3;
+}
+
+// ---------------------------------------------------------------------------
+// call when ww_decode_keys() returns a character, before anything is queued
+// for it. starts timing the key unless another one is being timed.
+// ---------------------------------------------------------------------------
+void latency_decoded(void) {
+   if (!keyStampValid || (latencyStage != LATENCYIDLE))
+      return;
+   keyStampValid = FALSE;
+   timedStamp = keyStamp;
+   decodedTime = elapsed(timedStamp,latency_now());
+   latencyWord = tx4_head;                      // the key's first word goes here in the queue
+   latencyStage = LATENCYARMED;                 // the UART4 ISR takes it from here
+}
+
+// ---------------------------------------------------------------------------
+// records the times of the key being timed once its first word has been
+// acknowledged, or drops it if it hasn't been printed in LATENCYTIMEOUT.
+// ---------------------------------------------------------------------------
+void latency_check(void) {
+   unsigned int t;
+   unsigned char i;
+
+   if (latencyStage == LATENCYIDLE)
+      return;
+   if (latencyStage != LATENCYACKED) {
+      if (elapsed(timedStamp,latency_now()) > LATENCYTIMEOUT)
+         latencyStage = LATENCYIDLE;            // never printed
+      return;
+   }
+   if (latencyCount != 0xFFFF) {
+      t = elapsed(timedStamp,ackStamp);
+      if (t < latencyMin) latencyMin = t;
+      if (t > latencyMax) latencyMax = t;
+      latencySum += t;
+      decodedSum += decodedTime;
+      sentSum += elapsed(timedStamp,sentStamp);
+      ++latencyCount;
+      for (i = 0; (i < BINS-1) && (t >= binLimits[i]); i++);
+      if (++latencyBins[i] == 0xFF)             // a bin is full, halve them all
+         for (i = 0; i < BINS; i++)
+            latencyBins[i] >>= 1;
+   }
+   latencyStage = LATENCYIDLE;
+}
+
+// ---------------------------------------------------------------------------
+// prints "label", then t tenths of a millisecond
+// ---------------------------------------------------------------------------
+static void print_tenths(char *label,unsigned int t) {
+   printf("%s %u.%u ms\n",label,t/10,t%10);
+}
+
+// ---------------------------------------------------------------------------
+// prints the bin where the cumulative count first reaches "percent" of all
+// the keys in the histogram
+// ---------------------------------------------------------------------------
+static void print_percentile(char *label,unsigned char percent) {
+   unsigned int total,count;
+   unsigned char i;
+
+   total = 0;
+   for (i = 0; i < BINS; i++)
+      total += latencyBins[i];
+   count = 0;
+   for (i = 0; i < BINS-1; i++) {
+      count += latencyBins[i];
+      if ((unsigned long)count*100 >= (unsigned long)total*percent)
+         break;
+   }
+   if (i < BINS-1)
+      printf("%s under %u ms\n",label,binLimits[i]/10);
+   else
+      printf("%s %u ms or more\n",label,binLimits[BINS-2]/10);
+}
+
+// ---------------------------------------------------------------------------
+// prints the times on the UART1 monitor and starts counting again
+// ---------------------------------------------------------------------------
+void latency_report(void) {
+   unsigned char i;
+
+   printf("\n%s %u\n","Keys timed:          ",latencyCount);
+   if (latencyCount) {
+      print_tenths("Key to decoded avg:  ",decodedSum/latencyCount);
+      print_tenths("Key to sent avg:     ",sentSum/latencyCount);
+      print_tenths("Key to acked min:    ",latencyMin);
+      print_tenths("Key to acked avg:    ",latencySum/latencyCount);
+      print_tenths("Key to acked max:    ",latencyMax);
+      print_percentile("Key to acked 50%:    ",50);
+      print_percentile("Key to acked 90%:    ",90);
+      print_percentile("Key to acked 99%:    ",99);
+   }
+   latencyCount = 0;
+   latencyMin = 0xFFFF;
+   latencyMax = 0;
+   latencySum = 0;
+   decodedSum = 0;
+   sentSum = 0;
+   for (i = 0; i < BINS; i++)
+      latencyBins[i] = 0;
+}
@@ -4,8 +4,27 @@
 #define __UART2_H__
 
 void uart2_init(unsigned long baudrate);
+void uart2_baudrate(unsigned long baudrate);
+unsigned long uart2_autobaud(void);
 char char_avail2();
 char getchar2();
 char putchar2(char c);
+void uart2_check(void);
+void uart2_handshake(char xon);
+char uart2_enquired(void);
+void uart2_enquiry(char on);
+unsigned int uart2_waiting(void);
+unsigned char uart2_tx_free(void);
+void uart2_etx(char on);
+char uart2_etx_ack(unsigned int block);
+#define BAUDRATES 6                             // number of host baud rates in baudRates[]
+#define AUTOBAUD 0                              // uart2_init() and uart2_baudrate() value that waits for uart2_autobaud()
+extern code unsigned long baudRates[BAUDRATES]; // 9600 to 230400bps; defined in uart2.c
+
+#define HOLD_OFFLINE 0x01                       // uart2_hold() reasons: the Printer Board is offline
+#define HOLD_PACING  0x02                       // the printer has enough work queued
+#define HOLD_FLASH   0x04                       // the IAP flash is about to be erased
+
+void uart2_hold(unsigned char reason,char hold);
 
 #endif
\ No newline at end of file
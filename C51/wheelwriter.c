@@ -4,27 +4,66 @@
 //************************************************************************//
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <reg51.h>
 #include "stc51.h"
 #include "ww-uart3.h"
 #include "ww-uart4.h"
 #include "control.h"
+#include "eeprom.h"
 
 #define FALSE 0
 #define TRUE  1
-#define ON 0                                                // 0 turns the amber LED on
-#define OFF 1                                               // 1 turns the amber LED off
 
 unsigned char uSpacesPerChar = 10;                          // micro spaces per character (8 for 15cpi, 10 for 12cpi and PS, 12 for 10cpi)
 unsigned char uLinesPerLine = 16;                           // micro lines per line (12 for 15cpi; 16 for 10cpi, 12cpi and PS)
 unsigned int  uSpaceCount = 0;                              // number of micro spaces on the current line (for carriage return)
+unsigned int  uSpaceCarrier = 0;                            // number of micro spaces from the left margin to where the carrier actually is
+int           uLinesPending = 0;                            // micro lines the paper has yet to move (positive is paper up)
+
+#define LINEBUFSIZE 128                                     // characters held in the line buffer for bidirectional printing
+unsigned int  xdata linePos[LINEBUFSIZE];                   // micro space position of each character in the line buffer
+unsigned char xdata lineWheel[LINEBUFSIZE];                 // printwheel code of each character in the line buffer
+unsigned char xdata lineAttr[LINEBUFSIZE];                  // bit 0=bold
+signed char   xdata lineLevel[LINEBUFSIZE];                 // baseline of each character in the line buffer, micro lines from the line's baseline
+unsigned char lineCount = 0;                                // number of characters in the line buffer
+#define STRUCK 0x80                                         // lineAttr bit 7 marks a character already printed
+#define STRIKEWINDOW 16                                     // characters the optimized strike order chooses the next one from
+
+#define SPANBUFSIZE 16                                      // underline spans held for the line buffer
+unsigned int  xdata spanStart[SPANBUFSIZE];                 // micro space position where each underline span starts
+unsigned int  xdata spanEnd[SPANBUFSIZE];                   // micro space position where each underline span ends
+signed char   xdata spanLevel[SPANBUFSIZE];                 // baseline of each underline span
+unsigned char spanCount = 0;                                // number of underline spans
+signed char   baseline = 0;                                 // micro lines the baseline has been shifted on this line (positive is paper up)
+
+unsigned char wheelPosition = 1;                            // printwheel code last struck ('a' is at the 12 o'clock position after reset)
+long          xdata rotationSaved = 0;                      // printwheel positions of rotation saved by optimized strike order
+unsigned int  xdata linesOptimized = 0;                     // baselines printed in optimized strike order, when it was predicted to be quicker
+
+unsigned char xdata rawWords[4];                            // the raw command being received, rawWords[0] is 0x121
+unsigned char rawCount = 0;                                 // words of the raw command received so far, 0 between commands
+unsigned char rawLength;                                    // words in the raw command being received
+bit           rawSkipping = FALSE;                          // set while skipping a bad raw command
+unsigned int  xdata rawErrors = 0;                          // raw commands that were not sent to the Printer Board
+
+bit           keymap = FALSE;                               // when true, keys are decoded with the keymap in the IAP flash
+unsigned char keymapCount = 0;                              // keymap bytes loaded so far by ww_keymap_load()
+unsigned char keymapSum;                                    // sum of the keymap bytes loaded so far
+unsigned char keymapDigits;                                 // the first hex digit of the byte being loaded
+bit           keymapHalf;                                   // set when the first hex digit of a byte has been loaded
+unsigned int  keymapTick;                                   // tickCount when the last keymap character arrived
 
 extern unsigned char column;                                // defined in main.c
+extern volatile unsigned int tickCount;                     // defined in main.c
 extern bit localMode;                                       // defined in main.c
+extern bit relaying;                                        // defined in main.c
+extern bit bidirectional;                                   // defined in main.c
+extern bit optimizeStrikes;                                 // defined in main.c
+extern bit groupBaselines;                                  // defined in main.c
 
 sbit P_RESET  = P0^4;                                       // Power-On-Reset for Printer Board output pin 5 0=on, 1=off
 sbit F_RESET  = P1^4;                                       // Power-On-Reset for Function Board output pin 13 0=on, 1=off
-sbit amberLED = P0^6;                                       // amber LED connected to pin 6 0=on, 1=off
 
 //------------------------------------------------------------------------------------------------
 // ASCII character to Wheelwriter printwheel translation table used when printing to convert
@@ -59,8 +98,10 @@ char code ASCII2printwheel[96] =  {
 //------------------------------------------------------------------------------------------------
 
 //------------------------------------------------------------------------------------------------
-// Wheelwriter printwheel to ASCII character translation table used to convert
-// printwheel codes into ASCII characters when keys are pressed.
+// Printwheel to ASCII character translation table used to convert the printwheel code of a key
+// (1-96) into an ASCII character when keys are pressed. 0x00 means no character. Generated from
+// ASCII2printwheel[] by tools/wwkeymap.py, which also has the keys whose keycaps don't match the
+// printwheel, so the two directions can't disagree. Don't edit it here, run wwkeymap.py.
 // On an unmodified Wheelwriter keyboard with original wheelwriter keycaps:
 // the '' key produces '^'
 //     ''       "      '`'
@@ -71,21 +112,117 @@ char code ASCII2printwheel[96] =  {
 //     ''       "      '>'
 //     code+'['  "      '|'
 //     code+']'  "      '\'
+//     the '<' and '>' printwheel positions produce nothing
+
+char code printwheel2ASCII[97] = {
+//            a    n    r    m    c    s    d    h    l    f    k    ,    V    -    G
+       0x00,0x61,0x6E,0x72,0x6D,0x63,0x73,0x64,0x68,0x6C,0x66,0x6B,0x2C,0x56,0x2D,0x47,  // 00
+//       U    F    B    Z    H    P    )    R    L    S    N    C    T    D    E    I
+       0x55,0x46,0x42,0x5A,0x48,0x50,0x29,0x52,0x4C,0x53,0x4E,0x43,0x54,0x44,0x45,0x49,  // 10
+//       A    J    O    (    M    >    Y    <    /    W    9    K    3    X    1    2
+       0x41,0x4A,0x4F,0x28,0x4D,0x3E,0x59,0x3C,0x2F,0x57,0x39,0x4B,0x33,0x58,0x31,0x32,  // 20
+//       0    5    4    6    8    7    *    $    #    %    ^    +    `    @    Q    &
+       0x30,0x35,0x34,0x36,0x38,0x37,0x2A,0x24,0x23,0x25,0x5E,0x2B,0x60,0x40,0x51,0x26,  // 30
+//       ]    }    \    |    ~              [    {    !    ?    "    '    =    :    _
+       0x5D,0x7D,0x5C,0x7C,0x7E,0x00,0x00,0x5B,0x7B,0x21,0x3F,0x22,0x27,0x3D,0x3A,0x5F,  // 40
+//       ;    x    q    v    z    w    j    .    y    b    g    u    p    i    t    o
+       0x3B,0x78,0x71,0x76,0x7A,0x77,0x6A,0x2E,0x79,0x62,0x67,0x75,0x70,0x69,0x74,0x6F,  // 50
+//       e
+       0x65}; // 60
+//------------------------------------------------------------------------------------------------
 
-char code printwheel2ASCII[96] = {
-//       a    n    r    m    c    s    d    h    l    f    k    ,    V    _    G    U
-       0x61,0x6E,0x72,0x6D,0x63,0x73,0x64,0x68,0x6C,0x66,0x6B,0x2C,0x56,0x2D,0x47,0x55,
-//       F    B    Z    H    P    )    R    L    S    N    C    T    D    E    I    A
-       0x46,0x42,0x5A,0x48,0x50,0x29,0x52,0x4C,0x53,0x4E,0x43,0x54,0x44,0x45,0x49,0x41,
-//       J    O    (    M    .    Y    ,    /    W    9    K    3    X    1    2    0
-       0x4A,0x4F,0x28,0x4D,0x3E,0x59,0x3C,0x2F,0x57,0x39,0x4B,0x33,0x58,0x31,0x32,0x30,
-//       5    4    6    8    7    *    $    #    %    ^    +    `    @    Q    &    ]
-       0x35,0x34,0x36,0x38,0x37,0x2A,0x24,0x23,0x25,0x5E,0x2B,0x60,0x40,0x51,0x26,0x5D,
-//       }    \    |    ~            [    {    !    ?    "    '    =    :    -    ;
-       0x7D,0x5C,0x7C,0x7E,0x00,0x00,0x5B,0x7B,0x21,0x3F,0x22,0x27,0x3D,0x3A,0x5F,0x3B,
-//       x    q    v    z    w    j    .    y    b    g    u    p    i    t    o    e
-       0x78,0x71,0x76,0x7A,0x77,0x6A,0x2E,0x79,0x62,0x67,0x75,0x70,0x69,0x74,0x6F,0x65};                                                                           // 60
 //------------------------------------------------------------------------------------------------
+// Code key to ASCII character translation table used to convert Code key combinations into
+// control characters i.e. Code+C is converted into ^C. The index is the key's code from
+// 0x121,0x00E,code. 0x00 means no character. Code+Erase returns 0xF0, which main() uses to
+// toggle between 'line' and 'local' modes.
+//
+// printwheel2ASCII[] and codeKey2ASCII[] are the built-in keymap. A
+// keymap loaded into the IAP flash with <ESC><Y> has a marker byte, the 96 characters for
+// printwheel codes 1-96, then the 128 characters for the Code key combinations.
+
+char code codeKey2ASCII[128] = {
+//             1    Q         A         Z              2    W         S         X
+       0x00,0x00,0x11,0x00,0x01,0x00,0x1A,0x00,0x00,0x00,0x17,0x00,0x13,0x00,0x18,0x00,  // 00
+//             3    E         D         C         5    4    R    T    F    G    V    B
+       0x00,0x00,0x05,0x00,0x04,0x00,0x03,0x00,0x00,0x00,0x12,0x14,0x06,0x07,0x16,0x02,  // 10
+//        6    7    U    Y    J    H    M              8    I         K
+       0x00,0x00,0x15,0x19,0x0A,0x08,0x0D,0x00,0x00,0x00,0x09,0x00,0x0B,0x00,0x00,0x00,  // 20
+//             9    O         L                        0    P
+       0x00,0x00,0x0F,0x00,0x0C,0x00,0x00,0x00,0x00,0x00,0x10,0x00,0x00,0x00,0x00,0x00,  // 30
+//               LMar           TClr  uDn  Spc MRel       Tab RMar TSet            Ers
+       0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x1B,0x00,0x00,0x00,0x00,0x00,0x00,0xF0,  // 40
+//           PUp  PDn       uUp      CRtn  LSp
+       0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 50
+//                                         rel
+       0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 60
+//                                      N
+       0x00,0x00,0x00,0x00,0x00,0x00,0x0E,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}; // 70
+//------------------------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------------------------
+// Mechanical timing model. Estimates how many milliseconds the printer takes for each command
+// queued to it so that ww_drain_time() can predict when the queued work will be done. Characters
+// in the line buffer that haven't been queued yet are estimated at CHARMS each.
+//------------------------------------------------------------------------------------------------
+#define STRIKEMS      50                                    // hammer strike and settle
+#define WHEELMS(n)    (n)                                   // printwheel rotation, 1 millisecond per position
+#define CARRIERMS(n)  (20+((n)>>1))                         // carrier start and stop plus 1/2 millisecond per micro space
+#define PLATENMS(n)   (30+((n)<<1))                         // platen start and stop plus 2 milliseconds per micro line
+#define SPINMS        500                                   // printwheel spin
+#define CHARMS        (STRIKEMS+WHEELMS(24)+CARRIERMS(10)) // a character not queued yet: strike, average rotation, carrier
+
+#define KEYMAPVALID   0x4B                                  // first byte of a complete keymap in the IAP flash
+#define KEYMAPWHEEL   (KEYMAPADDR+1)                        // characters for printwheel codes 1-96
+#define KEYMAPCODE    (KEYMAPADDR+97)                       // characters for Code key combinations 0x00-0x7F
+#define KEYMAPSIZE    224                                   // bytes after the marker
+#define KEYMAPTIMEOUT 100                                   // 50 millisecond ticks the host may pause while loading a keymap (5 seconds)
+
+unsigned int busyUntil = 0;                                 // milliseconds() when the queued work is predicted to be done
+
+unsigned int milliseconds(void);                            // defined in main.c
+
+static void ww_work(unsigned int ms) {
+    unsigned int now;
+
+    now = milliseconds();
+    if ((int)(busyUntil-now) < 0)                           // the printer has caught up, the new work starts now
+        busyUntil = now;
+    busyUntil += ms;
+}
+
+//------------------------------------------------------------------------------------------------
+// returns the predicted milliseconds until the printer has finished everything queued to it and
+// the characters in the line buffer. Characters spooled from the host aren't counted: the spool
+// may hold a page or more, and pacing on it would keep it nearly empty. When the queue goes idle, with every command sent and acknowledged, busyUntil starts again from
+// now so that the model's errors don't pile up from one burst of printing to the next.
+//------------------------------------------------------------------------------------------------
+unsigned int ww_drain_time(void) {
+    int left;
+    unsigned long total;
+
+    if (printer_board_idle())
+        busyUntil = milliseconds();                         // re-anchor the prediction
+    left = busyUntil-milliseconds();
+    total = (unsigned long)lineCount*CHARMS;
+    if (left > 0)
+        total += left;
+    return (total > 0xFFFF) ? 0xFFFF : total;
+}
+
+//------------------------------------------------------------------------------------------------
+// printwheel positions between two printwheel codes. The printwheel has 96 positions (codes 1-96)
+// on a circle and turns whichever way is shorter, so it's never more than 48.
+//------------------------------------------------------------------------------------------------
+static unsigned char wheel_distance(unsigned char from,unsigned char to) {
+    unsigned char d;
+
+    d = (from > to) ? from-to : to-from;
+    return (d > 48) ? 96-d : d;                             // the shorter way around
+}
+
+void ww_print_line(void);
+static void ww_shift_baseline(int lines);
 
 //--------------------------------------------------------------------------------------------------
 // 1 - resets the Function Board
@@ -110,17 +247,68 @@ void ww_reset(unsigned char board) {
    F_RESET = 0;                                             // Function Board reset off
 }
 
+//------------------------------------------------------------------------------------------------
+// Linefeeds, reverse linefeeds, half and micro line movements only change uLinesPending. The paper
+// is moved here, just before the next character is struck or the carrier moves, with as few
+// vertical movement commands as possible: ups and downs cancel out, and each command carries up to
+// 31 micro lines in bits 0-4 of its 3rd word. Bit 7 of the 3rd word is set for paper up direction.
+//------------------------------------------------------------------------------------------------
+void ww_position_paper(void) {
+    unsigned char n;
+
+    while (uLinesPending) {
+        queue_to_printer_board(0x121);
+        queue_to_printer_board(0x005);                      // vertical movement
+        if (uLinesPending > 0) {
+            n = (uLinesPending > 31) ? 31 : uLinesPending;  // as many micro lines as the 5 bit field holds
+            queue_to_printer_board(0x080|n);                // bit 7 is set to indicate paper up direction
+            uLinesPending -= n;
+            ww_work(PLATENMS(n));
+        }
+        else {
+            n = (uLinesPending < -31) ? 31 : -uLinesPending;
+            queue_to_printer_board(0x000|n);                // bit 7 is cleared to indicate paper down direction
+            uLinesPending += n;
+            ww_work(PLATENMS(n));
+        }
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Spaces, tabs and backspaces only change uSpaceCount. The carrier is brought to uSpaceCount here,
+// with a single horizontal movement command, just before the next character is struck or on
+// carriage return. A run of spaces, tabs and backspaces therefore costs one command, and spaces
+// just before a carriage return cost nothing at all.
+// The Wheelwriter requires an eleven bit number which indicates the number of micro spaces to move.
+// The upper three bits of the 11-bit number are sent as the 3rd word of the command, and lower 8
+// bits are sent as the 4th word. Bit 7 of the 3rd word is set for left to right direction.
+//------------------------------------------------------------------------------------------------
+void ww_position_carrier(void) {
+    unsigned int s;
+
+    if (uSpaceCount == uSpaceCarrier)                       // nothing to do if the carrier is already there
+        return;
+    ww_position_paper();                                    // vertical movement goes first
+    queue_to_printer_board(0x121);
+    queue_to_printer_board(0x006);                          // move the carrier horizontally
+    if (uSpaceCount > uSpaceCarrier) {
+        s = uSpaceCount-uSpaceCarrier;                      // number of microspaces to move right
+        queue_to_printer_board(((s>>8)&0x007)|0x80);        // bit 7 is set for left to right direction, bits 0-2 = upper 3 bits of micro spaces to move
+    }
+    else {
+        s = uSpaceCarrier-uSpaceCount;                      // number of microspaces to move left
+        queue_to_printer_board((s>>8)&0x007);               // bit 7 is cleared for right to left direction, bits 0-2 = upper 3 bits of micro spaces to move
+    }
+    queue_to_printer_board(s&0xFF);                         // lower 8 bits of micro spaces to move
+    uSpaceCarrier = uSpaceCount;                            // the carrier is now where it should be
+    ww_work(CARRIERMS(s));
+}
+
 //------------------------------------------------------------------------------------------------
 // backspace, no erase. decreases micro space count by uSpacesPerChar.
 //------------------------------------------------------------------------------------------------
 void ww_backspace(void) {
-    amberLED = ON;
-    send_to_printer_board_wait(0x121);
-    send_to_printer_board_wait(0x006);                      // move the carrier horizontally
-    send_to_printer_board_wait(0x000);                      // bit 7 is cleared for right to left direction
-    send_to_printer_board_wait(uSpacesPerChar);
-    uSpaceCount -= uSpacesPerChar;
-    amberLED = OFF;
+    uSpaceCount -= uSpacesPerChar;                          // carrier catches up in ww_position_carrier()
 }
 
 //------------------------------------------------------------------------------------------------
@@ -128,57 +316,47 @@ void ww_backspace(void) {
 //------------------------------------------------------------------------------------------------
 void ww_micro_backspace(void) {
     if (uSpaceCount){                                       // only if the carrier is not at the left margin
-        amberLED = ON;
-        send_to_printer_board_wait(0x121);
-        send_to_printer_board_wait(0x006);                  // move the carrier horizontally
-        send_to_printer_board_wait(0x000);                  // bit 7 is cleared for right to left direction
-        send_to_printer_board_wait(0x001);                  // one microspace
-        --uSpaceCount;
-        amberLED = OFF;
+        --uSpaceCount;                                      // carrier catches up in ww_position_carrier()
     }
 }
 
 //------------------------------------------------------------------------------------------------
-// To return the carrier to the left margin, the Wheelwriter requires an eleven bit number which
-// indicates the number of micro spaces to move to reach the left margin. The upper three bits of
-// the 11-bit number are sent as the 3rd word of the command, and lower 8 bits are sent as the 4th
-// word. Bit 7 of the 3rd word is cleared to indicate carriage movement left direction.
-// resets micro space count back to zero.
+// returns the carrier to the left margin. resets micro space count back to zero.
+// in bidirectional or optimized mode the buffered line is printed instead and the carrier stays where it ends up.
 //------------------------------------------------------------------------------------------------
 void ww_carriage_return(void) {
-    amberLED = ON;
-    send_to_printer_board_wait(0x121);
-    send_to_printer_board_wait(0x006);                      // move the carrier horizontallly
-    send_to_printer_board_wait((uSpaceCount>>8)&0x007);     // bit 7 is cleared for right to left direction, bits 0-2 = upper 3 bits of micro spaces to left margin
-    send_to_printer_board_wait(uSpaceCount&0xFF);           // lower 8 bits of micro spaces to left margin
+    ww_print_line();                                        // anything buffered belongs on this line
     uSpaceCount = 0;                                        // clear count
-    amberLED = OFF;
+    if (!bidirectional && !optimizeStrikes)                 // bidirectional: next line starts from wherever this one ends
+        ww_position_carrier();                              // one move back to the left margin
+}
+
+//------------------------------------------------------------------------------------------------
+// space, no strike. increases micro space count by uSpacesPerChar.
+//------------------------------------------------------------------------------------------------
+void ww_space(void) {
+    uSpaceCount += uSpacesPerChar;                          // carrier catches up in ww_position_carrier()
+    if (uSpaceCount > 1450) {                               // right stop
+        ww_carriage_return();                               // automatically return to left margin
+        column = 1;
+    }
 }
 
 //------------------------------------------------------------------------------------------------
 // ww_spins the printwheel as a visual and audible indication
 //------------------------------------------------------------------------------------------------
 void ww_spin(void) {
-    amberLED = ON;
-    send_to_printer_board_wait(0x121);
-    send_to_printer_board_wait(0x007);
-    amberLED = OFF;
+    queue_to_printer_board(0x121);
+    queue_to_printer_board(0x007);
+    wheelPosition = 1;                                      // spin leaves 'a' at the 12 o'clock position
+    ww_work(SPINMS);
 }
 
 //------------------------------------------------------------------------------------------------
 // horizontal tab number of "spaces". updates micro space count.
 //------------------------------------------------------------------------------------------------
 void ww_horizontal_tab(unsigned char spaces) {
-    unsigned int s;
-
-    amberLED = ON;
-    s = spaces*uSpacesPerChar;                              // number of microspaces to move right
-    send_to_printer_board_wait(0x121);
-    send_to_printer_board_wait(0x006);                      // move the carrier horizontally
-    send_to_printer_board_wait(((s>>8)&0x007)|0x80);        // bit 7 is set for left to right direction, bits 0-2 = upper 3 bits of micro spaces to move right
-    send_to_printer_board_wait(s&0xFF);                     // lower 8 bits of micro spaces to move right
-    uSpaceCount += s;                                       // update micro space count
-    amberLED = OFF;
+    uSpaceCount += spaces*uSpacesPerChar;                   // carrier catches up in ww_position_carrier()
 }
 
 //------------------------------------------------------------------------------------------------
@@ -187,83 +365,439 @@ void ww_horizontal_tab(unsigned char spaces) {
 // lines other than the current line is not implemented yet.
 //------------------------------------------------------------------------------------------------
 void ww_erase_letter(unsigned char letter) {
-     amberLED = ON;
-     send_to_printer_board_wait(0x121);
-     send_to_printer_board_wait(0x006);                  // move the carrier horizontally
-     send_to_printer_board_wait(0x000);                  // bit 7 is cleared for right to left direction
-     send_to_printer_board_wait(uSpacesPerChar);         // number of micro spaces to move left
-     send_to_printer_board_wait(0x121);
-     send_to_printer_board_wait(0x004);                  // print on correction tape
-     send_to_printer_board_wait(ASCII2printwheel[letter-0x20]);
-     send_to_printer_board_wait(uSpacesPerChar);         // number of micro spaces to move right
+     ww_print_line();
+     ww_position_paper();
+     ww_position_carrier();                              // carrier must be on the letter to its right
+     queue_to_printer_board(0x121);
+     queue_to_printer_board(0x006);                      // move the carrier horizontally
+     queue_to_printer_board(0x000);                      // bit 7 is cleared for right to left direction
+     queue_to_printer_board(uSpacesPerChar);             // number of micro spaces to move left
+     queue_to_printer_board(0x121);
+     queue_to_printer_board(0x004);                      // print on correction tape
+     queue_to_printer_board(ASCII2printwheel[letter-0x20]);
+     queue_to_printer_board(uSpacesPerChar);             // number of micro spaces to move right
+     ww_work(CARRIERMS(uSpacesPerChar)+WHEELMS(wheel_distance(wheelPosition,ASCII2printwheel[letter-0x20]))+STRIKEMS+CARRIERMS(uSpacesPerChar));
+     wheelPosition = ASCII2printwheel[letter-0x20];
      uSpaceCount -= uSpacesPerChar;                      // update the micro space count
-     amberLED = OFF;
+     uSpaceCarrier = uSpaceCount;
 }
 
 //------------------------------------------------------------------------------------------------
 // paper up one line
 //------------------------------------------------------------------------------------------------
 void ww_linefeed(void) {
-    amberLED = ON;
-    send_to_printer_board_wait(0x121);
-    send_to_printer_board_wait(0x005);                      // vertical movement
-    send_to_printer_board_wait(0x080|uLinesPerLine);        // bit 7 is set to indicate paper up direction, bits 0-4 indicate number of microlines for 1 full line
-    amberLED = OFF;
+    ww_print_line();                                        // buffered characters belong on the current line
+    uLinesPending += uLinesPerLine;                         // paper catches up in ww_position_paper()
 }
 
 //------------------------------------------------------------------------------------------------
 // paper down one line
 //------------------------------------------------------------------------------------------------
 void ww_reverse_linefeed(void) {
-    amberLED = ON;
-    send_to_printer_board_wait(0x121);
-    send_to_printer_board_wait(0x005);                      // vertical movement
-    send_to_printer_board_wait(0x000|uLinesPerLine);        // bit 7 is cleared to indicate paper down direction, bits 0-4 indicate number of microlines for 1 full line
-    amberLED = OFF;
+    ww_print_line();                                        // buffered characters belong on the current line
+    uLinesPending -= uLinesPerLine;                         // paper catches up in ww_position_paper()
 }
 
 //------------------------------------------------------------------------------------------------
 // paper up 1/2 line
 //------------------------------------------------------------------------------------------------
 void ww_paper_up(void) {
-    amberLED = ON;
-    send_to_printer_board_wait(0x121);
-    send_to_printer_board_wait(0x005);                      // vertical movement
-    send_to_printer_board_wait(0x080|(uLinesPerLine>>1));   // bit 7 is set to indicate up direction, bits 0-3 indicate number of microlines for 1/2 line
-    amberLED = OFF;
+    if (groupBaselines) {                                   // superscript or subscript, see ww_print_line()
+        ww_shift_baseline(uLinesPerLine>>1);
+        return;
+    }
+    ww_print_line();                                        // buffered characters belong on the current line
+    uLinesPending += uLinesPerLine>>1;                      // paper catches up in ww_position_paper()
 }
 
 //------------------------------------------------------------------------------------------------
 // paper down 1/2 line
 //------------------------------------------------------------------------------------------------
 void ww_paper_down(void) {
-    amberLED = ON;
-    send_to_printer_board_wait(0x121);
-    send_to_printer_board_wait(0x005);                      // vertical movement
-    send_to_printer_board_wait(0x000|(uLinesPerLine>>1));   // bit 7 is cleared to indicate down direction, bits 0-3 indicate number of microlines for 1/2 full line
-    amberLED = OFF;
+    if (groupBaselines) {                                   // superscript or subscript, see ww_print_line()
+        ww_shift_baseline(-(uLinesPerLine>>1));
+        return;
+    }
+    ww_print_line();                                        // buffered characters belong on the current line
+    uLinesPending -= uLinesPerLine>>1;                      // paper catches up in ww_position_paper()
 }
 
 //------------------------------------------------------------------------------------------------
 // paper up 1/8 line
 //------------------------------------------------------------------------------------------------
 void ww_micro_up(void) {
-    amberLED = ON;
-    send_to_printer_board_wait(0x121);
-    send_to_printer_board_wait(0x005);                      // vertical movement
-    send_to_printer_board_wait(0x080|(uLinesPerLine>>3));   // bit 7 is set to indicate up direction, bits 0-3 indicate number of microlines for 1/8 full line or 1/48"
-    amberLED = OFF;
+    if (groupBaselines) {                                   // superscript or subscript, see ww_print_line()
+        ww_shift_baseline(uLinesPerLine>>3);
+        return;
+    }
+    ww_print_line();                                        // buffered characters belong on the current line
+    uLinesPending += uLinesPerLine>>3;                      // 1/8 full line or 1/48"
 }
 
 //------------------------------------------------------------------------------------------------
 // paper down 1/8 line
 //------------------------------------------------------------------------------------------------
 void ww_micro_down(void) {
-    amberLED = ON;
-    send_to_printer_board_wait(0x121);
-    send_to_printer_board_wait(0x005);                      // vertical movement
-    send_to_printer_board_wait(0x000|(uLinesPerLine>>3));   // bit 7 is cleared to indicate down direction, bits 0-3 indicate number of microlines for 1/8 full line or 1/48"
-    amberLED = OFF;
+    if (groupBaselines) {                                   // superscript or subscript, see ww_print_line()
+        ww_shift_baseline(-(uLinesPerLine>>3));
+        return;
+    }
+    ww_print_line();                                        // buffered characters belong on the current line
+    uLinesPending -= uLinesPerLine>>3;                      // 1/8 full line or 1/48"
+}
+
+//-----------------------------------------------------------
+// micro spaces between two carrier positions
+//-----------------------------------------------------------
+static unsigned int carrier_distance(unsigned int from,unsigned int to) {
+     return (from > to) ? from-to : to-from;
+}
+
+//-----------------------------------------------------------
+// Strikes the character at printwheel position "printwheel" where the carrier is now, then
+// advances the carrier "advance" micro spaces. attr bit 0 = bold.
+// Bold strikes the character a second time one micro space to the right.
+//-----------------------------------------------------------
+static void ww_strike(unsigned char printwheel,unsigned char attr,unsigned char advance) {
+     queue_to_printer_board(0x121);
+     queue_to_printer_board(0x003);
+     queue_to_printer_board(printwheel);
+     if (attr & 0x01) {                                  // if the bold bit is set
+         queue_to_printer_board(0x001);                  // advance carriage by one micro space
+         queue_to_printer_board(0x121);
+         queue_to_printer_board(0x003);
+         queue_to_printer_board(printwheel);             // re-print the character offset by one micro space
+         if (advance) {
+             queue_to_printer_board(advance-1);          // advance carriage the remaining micro spaces
+         }
+         else {
+             queue_to_printer_board(0x000);              // carrier is left one micro space to the right
+             advance = 1;
+         }
+     }
+     else { // not boldprint
+         queue_to_printer_board(advance);
+     }
+     uSpaceCarrier += advance;                           // the strike moved the carrier
+     ww_work(WHEELMS(wheel_distance(wheelPosition,printwheel))+((attr & 0x01) ? STRIKEMS*2 : STRIKEMS)+(advance>>1));
+     wheelPosition = printwheel;                         // where the printwheel was left
+}
+
+//-----------------------------------------------------------
+// Strike order cost model. The cost of striking the character at
+// printwheel code "wheel" and micro space "pos" next, with the
+// printwheel at "from" and the carrier at "at", is the time the
+// timing model gives for getting there: WHEELMS() for the printwheel
+// rotation and, unless the carrier is already there, CARRIERMS() for
+// the carrier. The carrier's 20 millisecond start and stop is worth
+// 20 positions of rotation, so the optimized order only leaves the
+// next character to the right for one that saves more rotation than
+// the trip costs.
+//-----------------------------------------------------------
+static unsigned int strike_cost(unsigned char from,unsigned int at,unsigned char wheel,unsigned int pos) {
+     unsigned int d;
+
+     d = carrier_distance(at,pos);
+     return WHEELMS(wheel_distance(from,wheel))+(d ? CARRIERMS(d) : 0);
+}
+
+//-----------------------------------------------------------
+// returns the cost model's milliseconds for striking the characters
+// on baseline "level" one after the other, left to right or right to
+// left, the way ww_print_level() does without optimizeStrikes.
+//-----------------------------------------------------------
+static unsigned long ww_plain_cost(signed char level,char leftToRight) {
+     unsigned long total = 0;
+     unsigned int carrier;
+     unsigned char i,j,wheel;
+
+     wheel = wheelPosition;
+     carrier = uSpaceCarrier;
+     for (i=0; i<lineCount; ++i) {
+         j = leftToRight ? i : lineCount-1-i;
+         if (lineLevel[j] == level) {
+             total += strike_cost(wheel,carrier,lineWheel[j],linePos[j]);
+             wheel = lineWheel[j];
+             carrier = leftToRight ? linePos[j]+uSpacesPerChar : linePos[j];
+         }
+     }
+     return total;
+}
+
+//-----------------------------------------------------------
+// Greedy strike order for the characters on baseline "level": the
+// next character is always the cheapest one by the cost model from
+// where the printwheel and carrier would be, chosen from the first
+// STRIKEWINDOW characters not struck yet. That keeps each choice to
+// STRIKEWINDOW cost estimates however long the line is, while still
+// letting all the '-' of a rule in a table be struck one after the
+// other. Marks the characters STRUCK and returns the predicted
+// milliseconds. When "strike" is TRUE the characters are struck as
+// they're chosen; when it's FALSE the order is only costed.
+//-----------------------------------------------------------
+static unsigned long ww_greedy_order(signed char level,char strike) {
+     unsigned long total = 0;
+     unsigned int cost,best,carrier;
+     unsigned char j,n,wheel,start = 0,next = 0;
+
+     wheel = wheelPosition;
+     carrier = uSpaceCarrier;
+     while (TRUE) {
+         best = 0xFFFF;
+         n = 0;
+         for (j=start; (j<lineCount) && (n<STRIKEWINDOW); ++j) {
+             if ((lineAttr[j] & STRUCK) || (lineLevel[j] != level)) // skip characters already printed or on another baseline
+                 continue;
+             if (!n)
+                 start = j;                              // nothing to the left of here is left to strike
+             ++n;
+             cost = strike_cost(wheel,carrier,lineWheel[j],linePos[j]);
+             if (cost < best) {
+                 best = cost;
+                 next = j;
+             }
+         }
+         if (!n)
+             return total;
+         total += best;
+         if (strike) {
+             rotationSaved -= wheel_distance(wheel,lineWheel[next]);
+             uSpaceCount = linePos[next];
+             ww_position_carrier();                      // absolute carrier position for each character
+             ww_strike(lineWheel[next],lineAttr[next],uSpacesPerChar);
+         }
+         lineAttr[next] |= STRUCK;
+         wheel = lineWheel[next];
+         carrier = linePos[next]+uSpacesPerChar;
+     }
+}
+
+//-----------------------------------------------------------
+// Prints the characters of the line buffer on baseline "level" in
+// the greedy order when the cost model says it's quicker than "plain",
+// the cost of striking them in order. On ordinary text the greedy
+// order's jumps seldom pay for themselves, so most lines of prose are
+// left to the plain order and only tables and rules are reordered.
+// Returns FALSE, with nothing printed, when the plain order is no
+// slower. The rotation saved compared to striking in micro space
+// order is added to rotationSaved.
+//-----------------------------------------------------------
+static char ww_print_level_optimized(signed char level,unsigned long plain) {
+     unsigned char i,wheel;
+     unsigned long greedy;
+
+     greedy = ww_greedy_order(level,FALSE);
+     for (i=0; i<lineCount; ++i) {
+         if (lineLevel[i] == level)
+             lineAttr[i] &= ~STRUCK;                     // only costed, not struck yet
+     }
+     if (greedy >= plain)
+         return FALSE;
+
+     wheel = wheelPosition;                              // rotation if the line were struck left to right
+     for (i=0; i<lineCount; ++i) {
+         if (lineLevel[i] == level) {
+             rotationSaved += wheel_distance(wheel,lineWheel[i]);
+             wheel = lineWheel[i];
+         }
+     }
+     ww_greedy_order(level,TRUE);                        // the same choices again, struck this time
+     ++linesOptimized;
+     return TRUE;
+}
+
+//-----------------------------------------------------------
+// Prints the characters of the line buffer on baseline "level", in
+// whichever direction starts nearer to where the carrier is now. Left
+// to right, each strike advances the carrier as usual. Right to left,
+// each strike advances zero micro spaces and the carrier is moved
+// back to the next character, so the carrier never makes an empty
+// trip back to the left margin. With optimizeStrikes the order comes
+// from the cost model instead. Underlining follows in its own pass
+// with the printwheel parked on '_'.
+//-----------------------------------------------------------
+static void ww_print_level(signed char level) {
+     unsigned char i,first,last,n;
+     char leftToRight;
+
+     first = last = 0xFF;
+     for (i=0; i<lineCount; ++i) {                       // leftmost and rightmost characters on this baseline
+         if (lineLevel[i] == level) {
+             if (first == 0xFF)
+                 first = i;
+             last = i;
+         }
+     }
+     leftToRight = (first != 0xFF) && (carrier_distance(uSpaceCarrier,linePos[first]) <= carrier_distance(uSpaceCarrier,linePos[last]));
+     if (first == 0xFF) {
+         // no characters on this baseline, only underlining
+     }
+     else if (optimizeStrikes && ww_print_level_optimized(level,ww_plain_cost(level,leftToRight))) {
+         // struck in the optimized order, the cost model found it quicker
+     }
+     else if (leftToRight) {
+         for (i=first; i<=last; ++i) {                   // left end is nearer, print left to right
+             if (lineLevel[i] == level) {
+                 uSpaceCount = linePos[i];
+                 ww_position_carrier();
+                 ww_strike(lineWheel[i],lineAttr[i],uSpacesPerChar);
+             }
+         }
+     }
+     else {
+         for (i=last+1; i-- > first; ) {                 // right end is nearer, print right to left
+             if (lineLevel[i] == level) {
+                 uSpaceCount = linePos[i];
+                 ww_position_carrier();
+                 ww_strike(lineWheel[i],lineAttr[i],0);
+             }
+         }
+     }
+
+     first = last = 0xFF;
+     for (i=0; i<spanCount; ++i) {                       // leftmost and rightmost underline spans on this baseline
+         if (spanLevel[i] == level) {
+             if (first == 0xFF)
+                 first = i;
+             last = i;
+         }
+     }
+     if (first == 0xFF) {
+         return;
+     }
+     if (carrier_distance(uSpaceCarrier,spanStart[first]) <= carrier_distance(uSpaceCarrier,spanEnd[last])) {
+         for (i=first; i<=last; ++i) {                   // left to right
+             if (spanLevel[i] == level) {
+                 for (uSpaceCount=spanStart[i]; uSpaceCount<spanEnd[i]; uSpaceCount+=uSpacesPerChar) {
+                     ww_position_carrier();              // the carrier only moves on its own between spans
+                     ww_strike(0x04F,0,uSpacesPerChar); // print '_' underscore
+                 }
+             }
+         }
+     }
+     else {
+         for (i=last+1; i-- > first; ) {                 // right to left
+             if (spanLevel[i] == level) {
+                 n = (spanEnd[i]-spanStart[i]+uSpacesPerChar-1)/uSpacesPerChar; // the same strikes as left to right
+                 uSpaceCount = spanStart[i]+n*uSpacesPerChar;
+                 while (n--) {
+                     uSpaceCount -= uSpacesPerChar;
+                     ww_position_carrier();
+                     ww_strike(0x04F,0,0);               // print '_' underscore
+                 }
+             }
+         }
+     }
+}
+
+//-----------------------------------------------------------
+// Adds the character at the current micro space count to the
+// underline span on the same baseline that it touches, or starts a
+// new span, keeping the span list in micro space order.
+//-----------------------------------------------------------
+static void ww_underline(void) {
+     unsigned char i;
+
+     for (i=0; i<spanCount; ++i) {
+         if ((spanLevel[i] == baseline) && (uSpaceCount <= spanEnd[i]) && (uSpaceCount+uSpacesPerChar >= spanStart[i])) {
+             if (uSpaceCount < spanStart[i])
+                 spanStart[i] = uSpaceCount;
+             if (uSpaceCount+uSpacesPerChar > spanEnd[i])
+                 spanEnd[i] = uSpaceCount+uSpacesPerChar;
+             return;
+         }
+     }
+     if (spanCount == SPANBUFSIZE)                       // if the span list is full, print what's there to make room
+         ww_print_line();
+     i = spanCount++;
+     while (i && (spanStart[i-1] > uSpaceCount)) {
+         spanStart[i] = spanStart[i-1];
+         spanEnd[i] = spanEnd[i-1];
+         spanLevel[i] = spanLevel[i-1];
+         --i;
+     }
+     spanStart[i] = uSpaceCount;
+     spanEnd[i] = uSpaceCount+uSpacesPerChar;
+     spanLevel[i] = baseline;
+}
+
+//-----------------------------------------------------------
+// Returns the nearest baseline above (up) or below (!up) "level"
+// that has characters or underlining in the line buffer, NOLEVEL if none.
+//-----------------------------------------------------------
+#define NOLEVEL 0x7FFF
+
+static int next_level(int level,unsigned char up) {
+     int next = NOLEVEL;
+     unsigned char i;
+
+     for (i=0; i<lineCount; ++i) {
+         if (up ? (lineLevel[i] > level) && ((next == NOLEVEL) || (lineLevel[i] < next)) : (lineLevel[i] < level) && ((next == NOLEVEL) || (lineLevel[i] > next)))
+             next = lineLevel[i];
+     }
+     for (i=0; i<spanCount; ++i) {
+         if (up ? (spanLevel[i] > level) && ((next == NOLEVEL) || (spanLevel[i] < next)) : (spanLevel[i] < level) && ((next == NOLEVEL) || (spanLevel[i] > next)))
+             next = spanLevel[i];
+     }
+     return next;
+}
+
+//-----------------------------------------------------------
+// Prints the characters held in the line buffer, one baseline at a
+// time. With groupBaselines, superscripts and subscripts are kept on
+// their own baselines so the paper moves once per baseline per line
+// instead of twice for every shifted character. Baselines are visited
+// lowest first or highest first, whichever makes the shorter trip
+// from the line's baseline to where the paper must end up.
+// The micro space count is not changed.
+//-----------------------------------------------------------
+void ww_print_line(void) {
+     unsigned int logical;
+     int level,paper,lowest,highest;
+     unsigned char i,up;
+
+     if (lineCount || spanCount) {
+         logical = uSpaceCount;                          // remember where the next character goes
+         ww_position_paper();                            // paper to the line's baseline
+         lowest = highest = 0;
+         for (i=0; i<lineCount; ++i) {
+             if (lineLevel[i] < lowest) lowest = lineLevel[i];
+             if (lineLevel[i] > highest) highest = lineLevel[i];
+         }
+         for (i=0; i<spanCount; ++i) {
+             if (spanLevel[i] < lowest) lowest = spanLevel[i];
+             if (spanLevel[i] > highest) highest = spanLevel[i];
+         }
+         up = (-lowest+abs(baseline-highest) <= highest+abs(baseline-lowest));
+         paper = 0;
+         level = next_level(up ? lowest-1 : highest+1,up);
+         while (level != NOLEVEL) {
+             uLinesPending += level-paper;               // paper to this baseline
+             ww_position_paper();
+             paper = level;
+             ww_print_level(level);
+             level = next_level(level,up);
+         }
+         uLinesPending += baseline-paper;                // paper catches up with the last baseline shift in ww_position_paper()
+         lineCount = 0;                                  // line buffer is empty again
+         spanCount = 0;
+         uSpaceCount = logical;
+     }
+     else {
+         uLinesPending += baseline;
+     }
+     baseline = 0;                                       // the next line starts from here
+}
+
+//-----------------------------------------------------------
+// Moves the baseline for the characters that follow "lines" micro
+// lines (positive is paper up) without moving the paper yet.
+// See ww_print_line().
+//-----------------------------------------------------------
+static void ww_shift_baseline(int lines) {
+     if ((baseline+lines > 96) || (baseline+lines < -96)) // keep the baseline within a signed char
+         ww_print_line();
+     baseline += lines;
 }
 
 //-----------------------------------------------------------
@@ -272,27 +806,53 @@ void ww_micro_down(void) {
 // Handles bold, continuous and multiple word underline printing.
 // Carrier moves to the right by uSpacesPerChar.
 // Increases the micro space count by uSpacesPerChar for each letter printed.
+// Spaces that need no underline are not struck, see ww_position_carrier().
+// In bidirectional, optimized or grouped baseline mode the character is put in the line
+// buffer, in micro space order, instead of being struck now. see ww_print_line().
+// Underlining is then added to the underline spans, and all the
+// underscores are struck together at the end of the line instead of
+// turning the printwheel to '_' and back for every character.
+// Otherwise an underlined character is struck straight away over
+// its underscore, so nothing waits for the end of the line.
 //-----------------------------------------------------------
 void ww_print_character(unsigned char letter,attribute) {
-     amberLED = ON;
-     send_to_printer_board_wait(0x121);
-     send_to_printer_board_wait(0x003);
-     send_to_printer_board_wait(ASCII2printwheel[letter-0x20]);// ascii character (-0x20) as index to printwheel table
-     if ((attribute & 0x06) && ((letter!=0x20) || (attribute & 0x02))){// if underlining AND the letter is not a space OR continuous underlining is on
-         send_to_printer_board_wait(0x000);              // advance zero micro spaces
-         send_to_printer_board_wait(0x121);
-         send_to_printer_board_wait(0x003);
-         send_to_printer_board_wait(0x04F);              // print '_' underscore
+     unsigned char i,underline;
+
+     if ((letter==0x20) && !(attribute & 0x02)) {        // a space with nothing to underline is only a carrier move...
+         ww_space();                                     // ...which is left for ww_position_carrier()
+         return;
      }
-     if (attribute & 0x01) {                             // if the bold bit is set
-         send_to_printer_board_wait(0x001);              // advance carriage by one micro space
-         send_to_printer_board_wait(0x121);
-         send_to_printer_board_wait(0x003);
-         send_to_printer_board_wait(ASCII2printwheel[letter-0x20]);// re-print the character offset by one micro space
-         send_to_printer_board_wait((uSpacesPerChar)-1); // advance carriage the remaining micro spaces
+     underline = (attribute & 0x06) && ((letter!=0x20) || (attribute & 0x02)); // if underlining AND the letter is not a space OR continuous underlining is on
+     if (bidirectional || optimizeStrikes || groupBaselines || lineCount || spanCount) {
+         if (underline)
+             ww_underline();
+         if (letter==0x20) {
+             // a continuously underlined space is only an underscore
+         }
+         else {
+             if (lineCount == LINEBUFSIZE)               // if the line buffer is full, print what's there to make room
+                 ww_print_line();
+             i = lineCount++;
+             while (i && (linePos[i-1] > uSpaceCount)) { // keep the line buffer in micro space order (backspaces can go back)
+                 linePos[i] = linePos[i-1];
+                 lineWheel[i] = lineWheel[i-1];
+                 lineAttr[i] = lineAttr[i-1];
+                 lineLevel[i] = lineLevel[i-1];
+                 --i;
+             }
+             linePos[i] = uSpaceCount;
+             lineWheel[i] = ASCII2printwheel[letter-0x20]; // ascii character (-0x20) as index to printwheel table
+             lineAttr[i] = attribute & 0x01;             // bold
+             lineLevel[i] = baseline;
+         }
      }
-     else { // not boldprint
-         send_to_printer_board_wait(uSpacesPerChar);
+     else {
+         ww_position_paper();                            // bring the paper and carrier up to date first
+         ww_position_carrier();
+         if (underline)                                  // print '_' underscore first, the carrier only moves on for a space
+             ww_strike(0x04F,0,(letter==0x20) ? uSpacesPerChar : 0);
+         if (letter!=0x20)
+             ww_strike(ASCII2printwheel[letter-0x20],attribute & 0x01,uSpacesPerChar);// ascii character (-0x20) as index to printwheel table
      }
 
      uSpaceCount += uSpacesPerChar;                      // update the micro space count
@@ -300,7 +860,192 @@ void ww_print_character(unsigned char letter,attribute) {
          ww_carriage_return();                           // automatically return to left margin
          column = 1;
      }
-     amberLED = OFF;
+}
+
+//-----------------------------------------------------------
+// Brings the printer up to date: prints anything in the line
+// buffer and makes any pending paper and carrier movement.
+//-----------------------------------------------------------
+void ww_flush(void) {
+     ww_print_line();
+     ww_position_paper();
+     ww_position_carrier();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Raw mode. Each character from the host is the lower 8 bits of a 9 bit word for the Printer Board.
+// Only the first word of a command, 0x121, has bit 8 set, so a command arrives as 0x21 followed by
+// the rest of its words:
+//   0x21,0x03,<printwheel code>,<micro spaces>     strike, then move the carrier right
+//   0x21,0x04,<printwheel code>,<micro spaces>     strike on the correction tape, then move right
+//   0x21,0x05,<micro lines>                        move the paper, bit 7 is set for paper up
+//   0x21,0x06,<direction, upper 3 bits>,<lower 8 bits> move the carrier, bit 7 is set for right
+//   0x21,0x07                                      spin the printwheel
+// A command is queued to the Printer Board only once all of it has arrived and been checked: the
+// printwheel code must be 1-96 and the carrier must stay between the left margin and the right stop.
+// Anything else is counted in rawErrors and skipped up to the next 0x21. uSpaceCount, column and
+// the timing model follow the carrier. Returns FALSE, without using the character, when ESC
+// arrives between commands; the host is leaving raw mode. Call ww_flush() before the first command.
+//--------------------------------------------------------------------------------------------------
+char ww_raw(unsigned char c) {
+    unsigned int s;
+    unsigned char i;
+
+    if (!rawCount) {                                        // between commands...
+        if (c == ESC)
+            return FALSE;                                   // ...ESC leaves raw mode
+        if (c == 0x21) {                                    // all commands must start with 0x121
+            rawCount = 1;
+            rawSkipping = FALSE;
+        }
+        else if (!rawSkipping) {
+            ++rawErrors;                                    // count each bad command once
+            rawSkipping = TRUE;
+        }
+        return TRUE;
+    }
+    rawWords[rawCount++] = c;
+    if (rawCount == 2) {                                    // the command tells how many words follow
+        switch (c) {
+            case 0x003:
+            case 0x004:
+            case 0x006:
+                rawLength = 4;
+                break;
+            case 0x005:
+                rawLength = 3;
+                break;
+            case 0x007:
+                rawLength = 2;
+                break;
+            default:                                        // not a command raw mode passes on
+                rawCount = 0;
+                ++rawErrors;
+                rawSkipping = TRUE;
+                return TRUE;
+        }
+    }
+    if (rawCount < rawLength)
+        return TRUE;                                        // wait for the rest of the command
+    rawCount = 0;
+
+    switch (rawWords[1]) {
+        case 0x003:
+        case 0x004:
+            if (!rawWords[2] || (rawWords[2] > 96) || (uSpaceCarrier+rawWords[3] > 1450)) {
+                ++rawErrors;                                // no such printwheel position or past the right stop
+                return TRUE;
+            }
+            uSpaceCarrier += rawWords[3];                   // the strike moves the carrier
+            ww_work(WHEELMS(wheel_distance(wheelPosition,rawWords[2]))+STRIKEMS+(rawWords[3]>>1));
+            wheelPosition = rawWords[2];
+            break;
+        case 0x005:
+            ww_work(PLATENMS(rawWords[2]&0x1F));
+            break;
+        case 0x006:
+            s = ((unsigned int)(rawWords[2]&0x07)<<8)|rawWords[3];
+            if ((rawWords[2] & 0x78) || ((rawWords[2] & 0x80) ? (uSpaceCarrier+s > 1450) : (s > uSpaceCarrier))) {
+                ++rawErrors;                                // not a movement or past the margin or the right stop
+                return TRUE;
+            }
+            if (rawWords[2] & 0x80)
+                uSpaceCarrier += s;
+            else
+                uSpaceCarrier -= s;
+            ww_work(CARRIERMS(s));
+            break;
+        case 0x007:
+            wheelPosition = 1;                              // spin leaves 'a' at the 12 o'clock position
+            ww_work(SPINMS);
+            break;
+    }
+    queue_to_printer_board(0x121);
+    for (i = 1; i < rawLength; i++)
+        queue_to_printer_board(rawWords[i]);
+    uSpaceCount = uSpaceCarrier;                            // the carrier is where the next character goes
+    column = uSpaceCount/uSpacesPerChar+1;
+    return TRUE;
+}
+
+//--------------------------------------------------------------------------------------------------
+// In relay mode the Printer Board moves the carrier for the Function Board by itself. Keeps
+// uSpaceCarrier, uSpaceCount and column following it.
+//--------------------------------------------------------------------------------------------------
+static void ww_carrier_moved(int uSpaces) {
+    uSpaceCarrier += uSpaces;
+    uSpaceCount = uSpaceCarrier;
+    column = uSpaceCount/uSpacesPerChar+1;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Selects the keymap used to decode keys: the keymap loaded into the IAP flash when on is 1 and
+// there is a complete one there, the built-in keymap otherwise, see codeKey2ASCII[].
+// Returns the keymap selected.
+//--------------------------------------------------------------------------------------------------
+char ww_keymap(char on) {
+    keymap = on && (eeprom_read(KEYMAPADDR) == KEYMAPVALID);
+    return keymap;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Starts loading a keymap after <ESC><Y>: erases the old one and selects the built-in keymap until
+// the new one has been selected. eeprom_erase() pauses the host while the sector is erased, so the
+// host can send the keymap straight after <ESC><Y>.
+//--------------------------------------------------------------------------------------------------
+void ww_keymap_start(void) {
+    keymap = FALSE;
+    keymapCount = 0;
+    keymapSum = 0;
+    keymapHalf = FALSE;
+    eeprom_erase(KEYMAPADDR);
+    keymapTick = tickCount;                                 // the host's pause starts after the erase
+}
+
+//--------------------------------------------------------------------------------------------------
+// Returns TRUE when the host has paused for longer than KEYMAPTIMEOUT in the middle of a keymap,
+// so the load can be abandoned and the character that ended the pause handled as usual.
+//--------------------------------------------------------------------------------------------------
+char ww_keymap_late(void) {
+    return (tickCount-keymapTick) > KEYMAPTIMEOUT;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Loads the keymap into the IAP flash as it follows <ESC><Y> from the host. Each byte is sent as
+// two hex digits so that none of them can be taken for ENQ, ETX, XON, XOFF or a compressed code
+// on the way. The KEYMAPSIZE bytes are followed by a checksum byte that makes the sum of all of
+// them zero, and the marker is only written when it does. Spaces, carriage returns and line feeds
+// between the digits are ignored. Returns FALSE when the keymap has been loaded or, after any
+// other character, abandoned.
+//--------------------------------------------------------------------------------------------------
+char ww_keymap_load(unsigned char c) {
+    unsigned char n;
+
+    keymapTick = tickCount;
+    if ((c == SP) || (c == CR) || (c == LF))
+        return TRUE;
+    if ((c >= '0') && (c <= '9'))
+        n = c-'0';
+    else if (((c|0x20) >= 'a') && ((c|0x20) <= 'f'))
+        n = (c|0x20)-'a'+10;                                // upper or lower case hex digit
+    else
+        return FALSE;                                       // not a hex digit, abandon the keymap
+    if (!keymapHalf) {
+        keymapDigits = n<<4;                                // first digit of the byte
+        keymapHalf = TRUE;
+        return TRUE;
+    }
+    keymapHalf = FALSE;
+    n |= keymapDigits;
+    keymapSum += n;
+    if (keymapCount < KEYMAPSIZE) {
+        eeprom_write(KEYMAPWHEEL+keymapCount,n);
+        ++keymapCount;
+        return TRUE;
+    }
+    if (!keymapSum)                                         // n was the checksum byte
+        eeprom_write(KEYMAPADDR,KEYMAPVALID);               // the keymap is complete
+    return FALSE;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -314,6 +1059,10 @@ void ww_print_character(unsigned char letter,attribute) {
 // Horizontal movement commands are returned as Space, Backspace and Tab characters.
 //
 // Code key combinations are returned as control keys i.e. Code+C is returned as Control C.
+// Both are looked up in the keymap, see codeKey2ASCII[].
+//
+// In relay mode the words have already gone to the Printer Board; they are decoded only to follow
+// the carrier and to log the keys.
 //
 // The Code+Erase key combo returns 0xF0 which, when seen by the main() function,  is used to toggle between
 // 'line' and 'local' modes.
@@ -352,16 +1101,24 @@ char ww_decode_keys(unsigned int WWdata) {
             break;
         case 0x31:                                          // 0x121,0x003,printwheel code  has been received, waiting for microspaces...
             keystate = 0xFF;                                // reset keystate back to start
-            result = printwheel2ASCII[(lastWWdata-1)];      // get the ASCII code from the translation table
+            if (keymap && lastWWdata && (lastWWdata <= 96))
+                result = eeprom_read(KEYMAPWHEEL+lastWWdata-1); // get the ASCII code from the loaded keymap...
+            else if (!keymap && (lastWWdata <= 96))
+                result = printwheel2ASCII[lastWWdata];      // ...or the built-in one
+            if (relaying)
+                ww_carrier_moved(WWdata);                   // the strike moved the carrier
             break;
         case 0x50:                                          // 0x121,0x005 has been received, move paper vertically...
             keystate = 0xFF;
             if (((WWdata&0x1F)==uLinesPerLine)&&(WWdata&0x80))// one line AND paper up direction
                 result = CR;                                // LF used to detect when C Rtn key is pressed
-            if (localMode) {                                // if 'local' mode...
-                send_to_printer_board_wait(0x121);          // pass all vertical commands thru...
-                send_to_printer_board_wait(0x005);          // Paper Up, Paper Down, Micro Up, Micro Down and SAPI
-                send_to_printer_board_wait(WWdata);
+            if (localMode && !relaying) {                   // if 'local' mode...
+                ww_print_line();                            // anything still pending goes first
+                ww_position_paper();
+                queue_to_printer_board(0x121);              // pass all vertical commands thru...
+                queue_to_printer_board(0x005);              // Paper Up, Paper Down, Micro Up, Micro Down and SAPI
+                queue_to_printer_board(WWdata);
+                ww_work(PLATENMS(WWdata&0x1F));
             }
             break;
         case 0x60:                                          // 0x121,0x006 has been received...
@@ -372,6 +1129,8 @@ char ww_decode_keys(unsigned int WWdata) {
             break;
         case 0x61:                                          // 0x121,0x006,0x08X has been received, move carrier to the right...
             keystate = 0xFF;
+            if (relaying)
+                ww_carrier_moved(((lastWWdata&0x07)<<8)|WWdata);
             if ((WWdata>uSpacesPerChar)&&(WWdata<uSpacesPerChar*10)) // if more than one space but less than 10 spaces, must be horizontal tab
                 result = HT;
             else if (WWdata==uSpacesPerChar)
@@ -379,144 +1138,18 @@ char ww_decode_keys(unsigned int WWdata) {
             break;
         case 0x62:                                          // 0x121,0x006,0x00X has been received, move carrier to the left...
             keystate = 0xFF;
+            if (relaying)
+                ww_carrier_moved(-(int)(((lastWWdata&0x07)<<8)|WWdata));
             if (WWdata==uSpacesPerChar)
                 result = BS;
             break;
         case 0xE0:                                          // 0x121,0x00E has been received (code key combination)
             keystate = 0xFF;
-            // convert code key combinations into control keys i.e. code+C is converted into control C
-            switch(WWdata & 0x07F) {                        // bit 7 is cleared on WW3, set on WW6
-                case 0x001:                                 // Code+1
-                    break;
-                case 0x002:                                 // Code+Q
-                    result = DC1;                           // converted to ^Q
-                    break;
-                case 0x004:                                 // Code+A
-                    result = SOH;                           // converted to ^A
-                    break;
-                case 0x006:                                 // Code+Z
-                    result = SUB;                           // converted to ^Z
-                    break;
-                case 0x009:                                 // Code+2
-                    break;
-                case 0x00A:                                 // Code+W
-                    result = ETB;                           // converted to ^W
-                    break;
-                case 0x00C:                                 // Code+S
-                    result = DC3;                           // converted to ^S
-                    break;
-                case 0x00E:                                 // Code+X
-                    result = CAN;                           // converted to ^X
-                    break;
-                case 0x011:                                 // Code+3
-                    break;
-                case 0x012:                                 // Code+E
-                    result = ENQ;                           // converted to ^E
-                    break;
-                case 0x014:                                 // Code+D
-                    result = EOT;                           // converted to ^D
-                    break;
-                case 0x016:                                 // Code+C
-                    result = ETX;                           // converted to ^C
-                    break;
-                case 0x018:                                 // Code+5
-                    break;
-                case 0x019:                                 // Code+4
-                    break;
-                case 0x01A:                                 // Code+R
-                    result = DC2;                           // converted to ^R
-                    break;
-                case 0x01B:                                 // Code+T
-                    result = DC4;                           // converted to ^T
-                    break;
-                case 0x01C:                                 // Code+F
-                    result = ACK;                           // converted to ^F
-                    break;
-                case 0x01D:                                 // Code+G
-                    result = BEL;                           // converted to ^G
-                    break;
-                case 0x01E:                                 // Code+V
-                    result = SYN;                           // converted to ^V
-                    break;
-                case 0x01F:                                 // Code+B
-                    result = STX;                           // converted to ^B
-                    break;
-                case 0x020:                                 // Code+6
-                    break;
-                case 0x021:                                 // Code+7
-                    break;
-                case 0x022:                                 // Code+U
-                    result = NAK;                           // converted to ^U
-                    break;
-                case 0x023:                                 // Code+Y
-                    result = EM;                            // converted to ^Y
-                    break;
-                case 0x024:                                 // Code+J
-                    result = LF;                            // converted to ^J
-                    break;
-                case 0x025:                                 // Code+H
-                    result = BS;                            // converted to ^H
-                    break;
-                case 0x026:                                 // Code+M
-                    result = CR;                            // converted to ^M
-                    break;
-                case 0x029:                                 // Code+8
-                    break;
-                case 0x02A:                                 // Code+I
-                    result = HT;                            // converted to ^I
-                    break;
-                case 0x02C:                                 // Code+K
-                    result = VT;                            // converted to ^K
-                    break;
-                case 0x031:                                 // Code+9
-                    break;
-                case 0x032:                                 // Code+O
-                    result = SI;                            // converted to ^O
-                    break;
-                case 0x034:                                 // Code+L
-                    result = FF;                            // converted to ^L
-                    break;
-                case 0x039:                                 // Code+0
-                    break;
-                case 0x03A:                                 // Code+P
-                    result = DLE;                           // converted to ^P
-                    break;
-                case 0x042:                                 // Code+L Mar
-                    break;
-                case 0x045:                                 // Code+T Clr
-                    break;
-                case 0x046:                                 // Code+Micro Dn
-                    break;
-                case 0x047:                                 // Code+Space
-                    break;
-                case 0x048:                                 // Code+Mar Rel
-                    result = ESC;                           // converted to Escape
-                    break;
-                case 0x04A:                                 // Code+Tab
-                    break;
-                case 0x04B:                                 // Code+R Mar
-                    break;
-                case 0x04C:                                 // Code+T Set
-                    break;
-                case 0x4F:                                  // Code+Erase
-                    result = 0xF0;                          // return 0xF0 for Code+Erase key combo to toggle line/local mode flag
-                    break;
-                case 0x051:                                 // Code+Paper Up
-                    break;
-                case 0x052:                                 // Code+Paper Dn
-                    break;
-                case 0x054:                                 // Code+Micro Up
-                    break;
-                case 0x056:                                 // Code+C Rtn
-                    break;
-                case 0x057:                                 // Code+Line Space
-                    break;
-                case 0x067:                                 // code key released
-                    break;
-                case 0x076:                                 // Code+N
-                    result = SO;                            // converted to ^N
-                    break;
-            } // switch(WWdata & 0x17F)
+            WWdata &= 0x07F;                                // bit 7 is cleared on WW3, set on WW6
+            if (keymap)
+                result = eeprom_read(KEYMAPCODE+WWdata);    // get the ASCII code from the loaded keymap...
+            else
+                result = codeKey2ASCII[WWdata];             // ...or the built-in one
             break;
     }   // switch(keystate)
     lastWWdata = WWdata;                                    // save for next time
@@ -7,6 +7,11 @@ void ww_print_character(unsigned char letter,attribute);
 void ww_backspace(void);                        
 void ww_micro_backspace(void);
 void ww_space(void);
+void ww_position_carrier(void);
+void ww_position_paper(void);
+void ww_print_line(void);
+void ww_flush(void);
+unsigned int ww_drain_time(void);
 void ww_carriage_return(void);
 void ww_spin(void);
 void ww_horizontal_tab(unsigned char spaces);
@@ -17,6 +22,11 @@ void ww_paper_up(void);
 void ww_paper_down(void);
 void ww_micro_up(void);
 void ww_micro_down(void);
+char ww_raw(unsigned char c);
+char ww_keymap(char on);
+void ww_keymap_start(void);
+char ww_keymap_late(void);
+char ww_keymap_load(unsigned char c);
 char ww_decode_keys(unsigned int WWdata);
 void ww_reset(char board);
 
@@ -4,9 +4,15 @@
 #define __UART3_H__
 
 void uart3_init(void);
-void send_ACK_to_function_board(void);
 void send_to_function_board(unsigned int wwCommand);
 char function_board_cmd_avail(void);
 unsigned int get_function_board_cmd(void);
+void function_board_acks(char on);
+void function_board_relay(char on);
+void function_board_check(void);
+void function_board_hold(unsigned char reason,char hold);
+
+#define ACKHOLD_LINE 0x01                       // function_board_hold() reason: a cooked line is going to the host
+#define ACKHOLD_FULL 0x02                       // the UART3 receive buffer is nearly full
 
 #endif
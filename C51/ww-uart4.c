@@ -2,14 +2,23 @@
 // UART4 functions for connecting with the Wheelwriter Printer Board      //
 // for the Keil C51 Compiler                                              //
 //                                                                        //
-// Interrupt driven UART4 functions. UART4 uses a receive buffer in       //
-// internal MOVX SRAM. UART4 uses the Timer 4 for baud rate generation.   //
-// init_uart4 must be called before using functions. No syntax error      //
-// handling. No handshaking. RxD4 on pin 3, TxD4 on pin 4                 //
+// Interrupt driven UART4 functions. UART4 uses a receive buffer and a    //
+// command queue in internal MOVX SRAM. Words in the command queue are    //
+// sent by the ISR, one at a time, each after the Printer Board has       //
+// acknowledged the previous one. UART4 uses the Timer 4 for baud rate    //
+// generation. init_uart4 must be called before using functions. When a   //
+// word isn't acknowledged in time, the command it belongs to is sent     //
+// again from its 0x121; after ACKRETRIES tries the Printer Board is      //
+// considered offline. Each retry resets the watchdog, so a wait on the   //
+// queue reaches the offline state before the watchdog can fire.          //
+// RxD4 on pin 3, TxD4 on pin 4                                           //
 //************************************************************************//
 
+#include <stdio.h>
 #include <reg51.h>
 #include "stc51.h"
+#include "uart2.h"
+#include "latency.h"
 
 #define FALSE 0
 #define TRUE  1
@@ -23,29 +32,108 @@
     #error RBUFSIZE4 must be a power of 2.
 #endif
 
+#define TBUFSIZE4 64                            // must be 128, 64, 32 or 16 words
+#if TBUFSIZE4 < 16
+    #error TBUFSIZE4 may not be less than 16.
+#elif TBUFSIZE4 > 128
+    #error TBUFSIZE4 may not be greater than 128.
+#elif ((TBUFSIZE4 & (TBUFSIZE4-1)) != 0)
+    #error TBUFSIZE4 must be a power of 2.
+#endif
+
+#define ACKTIMEOUT 40                           // 50 millisecond ticks to wait for the Printer Board to acknowledge a word (2 seconds)
+#define ACKRETRIES 2                            // times a word is sent again before the Printer Board is considered offline
+#define PROBEINTERVAL 100                       // 50 millisecond ticks between tries to reach an offline Printer Board (5 seconds)
+
 volatile unsigned char rx4_head;                // receive interrupt index for UART4
 volatile unsigned char rx4_tail;                // receive read index for UART4
 volatile unsigned int xdata rx4_buf[RBUFSIZE4]; // receive buffer for UART4 in internal MOVX RAM
+volatile unsigned char tx4_head;                // index used to fill the Printer Board command queue
+volatile unsigned char tx4_tail;                // index used to empty the Printer Board command queue
+volatile unsigned char tx4_start;               // index of the 0x121 that starts the command being sent, kept for a retry
+volatile unsigned int xdata tx4_buf[TBUFSIZE4]; // Printer Board command queue in internal MOVX RAM
 volatile bit tx4_ready;                         // set when ready to transmit
+volatile bit tx4_busy;                          // set while a queued word waits for acknowledge from the Printer Board
 sbit WWbus4 = P0^2;                             // P0.2, (RXD4, pin 3) used to monitor the Wheelwriter BUS
+sbit amberLED = P0^6;                           // amber LED connected to pin 7 0=on, 1=off, lit while the queue is busy
+volatile unsigned char ackTimer;                // decremented every 50 milliseconds by timer 0, deadline for the acknowledge
+unsigned char ackRetries;                       // times the word waiting for acknowledge has been sent again
+unsigned int xdata ackTimeouts = 0;             // acknowledges that missed the deadline
+unsigned int xdata offlineEvents = 0;           // times the Printer Board has gone offline
+volatile bit printerOffline;                    // set while the Printer Board is not acknowledging
+bit offlineReported;                            // printerOffline as last reported
+extern volatile bit relayPending;               // defined in ww-uart3.c
+extern volatile bit ackOwed;                    // defined in ww-uart3.c
+extern volatile unsigned int ackWord;           // defined in ww-uart3.c
+extern volatile bit tx3_ready;                  // defined in ww-uart3.c
+extern volatile unsigned int tickCount;         // defined in main.c
+extern volatile unsigned char latencyStage;     // defined in latency.c
+extern unsigned char latencyWord;               // defined in latency.c
+extern volatile unsigned int sentStamp;         // defined in latency.c
+extern volatile unsigned int ackStamp;          // defined in latency.c
 
 // ---------------------------------------------------------------------------
 // UART4 interrupt service routine
 // ---------------------------------------------------------------------------
 void uart4_isr(void) interrupt 18 using 3 {
    unsigned int wwBusData;
+   bit idAsked;
 
     // UART4 transmit interrupt
     if (S4TI) {                                 // transmit interrupt?
       CLR_S4TI;                                 // clear transmit interrupt flag
       tx4_ready = TRUE;                         // transmit buffer is ready for a new character
+      if (tx4_busy || relayPending) SET_S4REN;  // queued or relayed word is out, re-enable reception to catch the reply
     }
 
     if(S4RI) {                                  // receive interrupt?
        CLR_S4RI;                                // clear receive interrupt flag
        wwBusData = S4BUF;                       // retrieve the lower 8 bits
        if (S4RB8) wwBusData |= 0x0100;          // ninth bit is in S3RB8
-       rx4_buf[rx4_head++ & (RBUFSIZE4-1)] = wwBusData;  // save it in the buffer
+       idAsked = (tx4_tail == (unsigned char)(tx4_start+1)) && (tx4_buf[tx4_tail & (TBUFSIZE4-1)] == 0x001);
+       if (relayPending) {                      // the reply to a word relayed from the Function Board...
+          relayPending = FALSE;
+          ackWord = wwBusData;                  // ...goes back to it as the acknowledge
+          ackOwed = TRUE;
+          if (tx3_ready) {                      // the UART3 ISR sends it as soon as nothing holds it
+             tx3_ready = FALSE;
+             SET_S3TI;
+          }
+          if (wwBusData)
+             rx4_buf[rx4_head++ & (RBUFSIZE4-1)] = wwBusData;  // a printwheel ID is for main() too
+       }
+       else if (tx4_busy && (!wwBusData || idAsked)) {// all zeros is the acknowledge for the queued word...
+          if (idAsked)                          // ...but the answer to 0x121,0x001 is the printwheel ID
+             rx4_buf[rx4_head++ & (RBUFSIZE4-1)] = wwBusData;  // which main() wants too
+          tx4_busy = FALSE;
+          ackRetries = 0;
+          printerOffline = FALSE;               // it's answering, so it's not offline
+          if ((latencyStage == LATENCYSENT) && (tx4_tail == latencyWord)) {
+             LATENCY_STAMP(ackStamp);           // the timed key's first word has been acknowledged
+             latencyStage = LATENCYACKED;
+          }
+          ++tx4_tail;                           // the word has been accepted, remove it from the queue
+          if (tx4_head != tx4_tail) {           // if there's another word waiting in the queue, send it now
+             wwBusData = tx4_buf[tx4_tail & (TBUFSIZE4-1)];
+             if (wwBusData == 0x121) tx4_start = tx4_tail; // a new command, the last one is done
+             tx4_ready = FALSE;
+             tx4_busy = TRUE;
+             ackTimer = ACKTIMEOUT;             // start the deadline for its acknowledge
+             if ((latencyStage == LATENCYARMED) && (tx4_tail == latencyWord)) {
+                LATENCY_STAMP(sentStamp);       // the timed key's first word is going out
+                latencyStage = LATENCYSENT;
+             }
+             CLR_S4REN;                         // clear S4REN to disable reception while transmitting
+             if (wwBusData & 0x100) SET_S4TB8; else CLR_S4TB8; // 9th bit
+             S4BUF = wwBusData & 0xFF;          // lower 8 bits
+          }
+          else {
+             tx4_start = tx4_tail;              // the last command is done
+             amberLED = 1;                      // queue is empty, turn off the amber LED
+          }
+       }
+       else
+          rx4_buf[rx4_head++ & (RBUFSIZE4-1)] = wwBusData;  // save it in the buffer
     }
 }
 
@@ -61,6 +149,13 @@ void uart4_isr(void) interrupt 18 using 3 {
 void uart4_init(void) {
     rx4_head = 0;                               // initialize UART4 buffer head/tail pointers.
     rx4_tail = 0;
+    tx4_head = 0;                               // initialize the command queue head/tail pointers.
+    tx4_tail = 0;
+    tx4_start = 0;
+    tx4_busy = FALSE;
+    ackRetries = 0;
+    printerOffline = FALSE;
+    offlineReported = FALSE;
 
     SET_S4ST4;                                  // set S4ST4 to select Timer 4 as baud rate generator for UART3.
     CLR_T4_CT;                                  // clear T2_C/T to make Timer 2 operate as timer instead of counter
@@ -78,28 +173,149 @@ void uart4_init(void) {
 }
 
 // ---------------------------------------------------------------------------
-// sends an unsigned integer as 11 bits (start bit, 9 data bits, stop bit)
-// to the Printer Board. waits for acknowledge from printer board.
+// call regularly from the main loop. if the Printer Board has not acknowledged
+// the word in flight by the deadline, sends the command it belongs to again
+// from its 0x121, so the Printer Board never sees half a command, up to
+// ACKRETRIES times. after that the Printer Board is offline: the host is held
+// off with RTS and the command is sent again every PROBEINTERVAL until the
+// Printer Board answers. nothing in the queue is lost. note that if only the
+// acknowledge for the last word was lost, the command is carried out twice.
+// the deadline is shorter than the watchdog timeout and every retry resets
+// the watchdog, so waiting on an unresponsive Printer Board gets here. a
+// queue left idle because a relayed word was going out is started here.
+// ---------------------------------------------------------------------------
+static void start_printer_board_queue(void);
+
+void printer_board_check(void) {
+   unsigned int wwCommand;
+
+   if (!tx4_busy && (tx4_head != tx4_tail))
+      start_printer_board_queue();
+
+   if (tx4_busy && !ackTimer) {
+      CLR_ES4;                                  // keep the ISR out while we look at the queue
+      if (tx4_busy && !ackTimer) {              // still no acknowledge
+         ++ackTimeouts;
+         if (printerOffline || (++ackRetries > ACKRETRIES)) {
+            printerOffline = TRUE;
+            ackTimer = PROBEINTERVAL;           // try again later
+         }
+         else
+            ackTimer = ACKTIMEOUT;
+         RESET_WDT;                             // a retry is progress, the deadline and ACKRETRIES bound it
+         tx4_tail = tx4_start;                  // start the command again from its 0x121
+         wwCommand = tx4_buf[tx4_tail & (TBUFSIZE4-1)];
+         tx4_ready = FALSE;
+         CLR_S4REN;                             // clear S4REN to disable reception while transmitting
+         if (wwCommand & 0x100) SET_S4TB8; else CLR_S4TB8; // 9th bit
+         S4BUF = wwCommand & 0xFF;              // lower 8 bits
+      }
+      SET_ES4;
+   }
+
+   if (printerOffline != offlineReported) {     // report changes in the Printer Board's state
+      offlineReported = printerOffline;
+      if (printerOffline) {
+         ++offlineEvents;
+         printf("\nPrinter Board offline\n");
+      }
+      else
+         printf("\nPrinter Board online\n");
+      uart2_hold(HOLD_OFFLINE,printerOffline);               // hold the host off while the Printer Board is offline
+   }
+}
+
 // ---------------------------------------------------------------------------
-void send_to_printer_board_wait(unsigned int wwCommand) {
+// returns 1 while the Printer Board is not acknowledging.
+// ---------------------------------------------------------------------------
+char printer_board_offline(void) {
+   return printerOffline;
+}
+
+// ---------------------------------------------------------------------------
+// starts sending the word at the tail of the command queue if the ISR is
+// not already busy with one. UART4 interrupt is disabled while checking, so
+// a word already going out is waited for first: only the ISR sets tx4_ready.
+// if a relayed word starts in between, the queue is left for
+// printer_board_check() to start.
+// ---------------------------------------------------------------------------
+static void start_printer_board_queue(void) {
+   unsigned int wwCommand;
+
    while (!tx4_ready);                          // wait until transmit buffer is empty
-   tx4_ready = 0;                               // clear flag
-   while(!WWbus4);                              // wait until the Wheelwriter bus goes high
-   CLR_S4REN;                                   // clear S4REN to disable reception
-   if (wwCommand & 0x100) SET_S4TB8; else CLR_S4TB8; // 9th bit
-   S4BUF = wwCommand & 0xFF;                    // lower 8 bits
-   while(!tx4_ready);                           // wait until finished transmitting
-   while(!WWbus4);                              // wait until the Wheelwriter bus goes high
-   while(WWbus4);                               // wait until the Wheelwriter bus goes low (acknowledge)
-   while(!WWbus4);                              // wait until the Wheelwriter bus goes high again
-   SET_S4REN;                                   // set S4REN to re-enable reception
+   CLR_ES4;                                     // keep the ISR out while we look at the queue
+   if (!tx4_busy && tx4_ready && (tx4_head != tx4_tail)) { // if idle and there's something in the queue...
+      wwCommand = tx4_buf[tx4_tail & (TBUFSIZE4-1)];
+      ackTimer = ACKTIMEOUT;                    // start the deadline for its acknowledge
+      while(!WWbus4 && ackTimer);               // wait until the Wheelwriter bus goes high
+      tx4_ready = FALSE;
+      tx4_busy = TRUE;
+      amberLED = 0;                             // amber LED on while the queue is busy
+      if ((latencyStage == LATENCYARMED) && (tx4_tail == latencyWord)) {
+         sentStamp = latency_now();             // the timed key's first word is going out
+         latencyStage = LATENCYSENT;
+      }
+      CLR_S4REN;                                // clear S4REN to disable reception while transmitting
+      if (wwCommand & 0x100) SET_S4TB8; else CLR_S4TB8; // 9th bit
+      S4BUF = wwCommand & 0xFF;                 // lower 8 bits
+   }
+   SET_ES4;
+}
+
+// ---------------------------------------------------------------------------
+// called over and over while waiting on the command queue. keeps the retries
+// going and resets the watchdog while the queue is moving or the Printer Board
+// is offline, so a long line from ww_print_line() can take as long as it needs
+// to print without resetting the MCU.
+// ---------------------------------------------------------------------------
+static void queue_wait(void) {
+   static unsigned char lastTail;
+
+   printer_board_check();
+   if (printerOffline || (tx4_tail != lastTail)) {
+      lastTail = tx4_tail;
+      RESET_WDT;                                // the queue is moving, or waiting for an offline Printer Board
+   }
+}
+
+// ---------------------------------------------------------------------------
+// puts an unsigned integer into the Printer Board command queue and returns.
+// the ISR sends it as 11 bits (start bit, 9 data bits, stop bit) once the
+// Printer Board has acknowledged everything ahead of it. waits only if
+// the queue is full.
+// ---------------------------------------------------------------------------
+void queue_to_printer_board(unsigned int wwCommand) {
+   while ((unsigned char)(tx4_head - tx4_start) >= TBUFSIZE4) { // wait while the queue is full, the command being sent is kept for a retry
+      queue_wait();                             // keep retrying while waiting
+   }
+   tx4_buf[tx4_head & (TBUFSIZE4-1)] = wwCommand;
+   ++tx4_head;
+   start_printer_board_queue();                 // get the ISR going if it's idle
+}
+
+// ---------------------------------------------------------------------------
+// returns 1 if the command queue is empty and the last word has been acknowledged.
+// ---------------------------------------------------------------------------
+char printer_board_idle(void) {
+   return (!tx4_busy && (tx4_head == tx4_tail));
+}
+
+// ---------------------------------------------------------------------------
+// waits until the command queue is empty and the last word has been
+// acknowledged.
+// ---------------------------------------------------------------------------
+void printer_board_drain(void) {
+   while (!printer_board_idle())
+      queue_wait();
 }
 
 // ---------------------------------------------------------------------------
 // sends an unsigned integer as 11 bits (start bit, 9 data bits, stop bit)
 // to the Printer Board. does not wait for acknowledge from printer board.
+// waits for the command queue to drain first.
 // ---------------------------------------------------------------------------
 void send_to_printer_board(unsigned int wwCommand) {
+   printer_board_drain();                       // wait until queued commands have been acknowledged
    while (!tx4_ready);                          // wait until transmit buffer is empty
    tx4_ready = 0;                               // clear flag
    while(!WWbus4);                              // wait until the Wheelwriter bus goes high
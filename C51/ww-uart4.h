@@ -5,7 +5,11 @@
 
 void uart4_init(void);
 void send_to_printer_board(unsigned int wwCommand);
-void send_to_printer_board_wait(unsigned int wwCommand);
+void queue_to_printer_board(unsigned int wwCommand);
+char printer_board_idle(void);
+void printer_board_drain(void);
+void printer_board_check(void);
+char printer_board_offline(void);
 char printer_board_reply_avail(void);
 unsigned int get_printer_board_reply(void);
 
@@ -7,9 +7,13 @@ sdcc -c uart1.c
 sdcc -c uart2.c
 sdcc -c ww-uart3.c
 sdcc -c ww-uart4.c
+sdcc -c eeprom.c
+sdcc -c host.c
+sdcc -c latency.c
 
 REM link...
-sdcc main.c wheelwriter.rel uart1.rel uart2.rel ww-uart3.rel ww-uart4.rel
+REM xdata from 0x000 up to the bytes at 0xEF0 that survive a reset, the linker fails if it doesn't fit
+sdcc --xram-loc 0x0000 --xram-size 0x0EF0 main.c wheelwriter.rel uart1.rel uart2.rel ww-uart3.rel ww-uart4.rel eeprom.rel host.rel latency.rel
 
 REM generate HEX file...
 packihx main.ihx > teletype.hex
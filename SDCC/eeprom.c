@@ -0,0 +1,85 @@
+//************************************************************************//
+// IAP (EEPROM) functions.                                                //
+// for the Small Device C Compiler (SDCC)                                 //
+//                                                                        //
+// The IAP15W4K61S4 has no separate data EEPROM. Any 512 byte sector of   //
+// the program flash that isn't used by the program can be read, erased   //
+// and written through the IAP registers. Erasing sets every byte in the  //
+// sector to 0xFF. Writing can only change bits from 1 to 0, so a sector  //
+// must be erased before its bytes are written again. The MCU stops for   //
+// about 21 milliseconds to erase a sector and 55 microseconds to write a //
+// byte, and no interrupts are serviced while it's stopped. Before it     //
+// erases, eeprom_erase() pauses the host, waits for the characters       //
+// already on their way and drains the Printer Board queue, so nothing    //
+// arrives from either while the MCU has stopped.                         //
+//************************************************************************//
+
+#include "reg51.h"
+#include "stc51.h"
+#include "uart2.h"
+#include "ww-uart4.h"
+
+#define FALSE 0
+#define TRUE  1
+
+#define IAPEN      0x80                         // IAP_CONTR: enable IAP operations
+#define IAPWAIT    0x03                         // IAP_CONTR: flash wait states for a 12 MHz system clock
+#define CMD_IDLE   0                            // IAP_CMD values
+#define CMD_READ   1
+#define CMD_WRITE  2
+#define CMD_ERASE  3
+#define QUIETMS    20                           // milliseconds without a character from the host before erasing
+
+unsigned int milliseconds(void);                // defined in main.c
+
+// ---------------------------------------------------------------------------
+// start the IAP command "cmd" at "address" and wait for it to finish
+// ---------------------------------------------------------------------------
+static void eeprom_command(unsigned char cmd,unsigned int address) {
+    IAP_CONTR = IAPEN|IAPWAIT;                  // enable IAP
+    IAP_CMD = cmd;
+    IAP_ADDRL = address;
+    IAP_ADDRH = address>>8;
+    IAP_TRIG = 0x5A;                            // the two byte trigger sequence starts the command...
+    IAP_TRIG = 0xA5;                            // the MCU holds here until it's finished
+    IAP_CONTR = 0;                              // disable IAP
+    IAP_CMD = CMD_IDLE;
+    IAP_TRIG = 0;
+    IAP_ADDRH = 0x80;                           // park the address, as the data sheet recommends
+    IAP_ADDRL = 0;
+}
+
+// ---------------------------------------------------------------------------
+// returns the byte at "address"
+// ---------------------------------------------------------------------------
+unsigned char eeprom_read(unsigned int address) {
+    eeprom_command(CMD_READ,address);
+    return IAP_DATA;
+}
+
+// ---------------------------------------------------------------------------
+// writes "value" to the byte at "address". the byte must have been erased.
+// ---------------------------------------------------------------------------
+void eeprom_write(unsigned int address,unsigned char value) {
+    IAP_DATA = value;
+    eeprom_command(CMD_WRITE,address);
+}
+
+// ---------------------------------------------------------------------------
+// erases the 512 byte sector that contains "address" once the host has been
+// paused and the Printer Board has acknowledged everything queued to it
+// ---------------------------------------------------------------------------
+void eeprom_erase(unsigned int address) {
+    unsigned int waiting,start;
+
+    uart2_hold(HOLD_FLASH,TRUE);                // RTS high or XOFF
+    printer_board_drain();
+    do {                                        // the host may send a few more before it stops
+        RESET_WDT;
+        waiting = uart2_waiting();
+        start = milliseconds();
+        while ((unsigned int)(milliseconds()-start) < QUIETMS);
+    } while (uart2_waiting() != waiting);
+    eeprom_command(CMD_ERASE,address);
+    uart2_hold(HOLD_FLASH,FALSE);
+}
@@ -0,0 +1,30 @@
+// for the Small Device C Compiler (SDCC)
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#define KEYSTAMPS 4                             // keys that can wait in the UART3 buffer with their stamps, must be a power of 2
+
+#define LATENCYIDLE  0                          // latencyStage: no key is being timed
+#define LATENCYARMED 1                          // the key has been decoded, its first Printer Board word hasn't been sent
+#define LATENCYSENT  2                          // the word has been sent, its acknowledge hasn't arrived
+#define LATENCYACKED 3                          // the word has been acknowledged, latency_check() records the times
+
+#define STAMPBASE ((65536-50000)/256)           // TH0 just after timer 0 reloads
+
+// the time now as a latency stamp in s: the low byte of tickCount and the 256 microsecond steps
+// of timer 0 within the tick. only for ISRs and code with interrupts disabled. a pending timer 0
+// interrupt with TH0 just reloaded means the tick has ended but hasn't been counted yet.
+#define LATENCY_STAMP(s) {                                 \
+    unsigned char h = TH0;                                 \
+    unsigned char t = tickCount;                           \
+    if (TF0 && (h < 0x80)) ++t;                            \
+    s = ((unsigned int)t<<8)|(unsigned char)(h-STAMPBASE); \
+}
+
+unsigned int latency_now(void);
+void latency_key(void);
+void latency_decoded(void);
+void latency_check(void);
+void latency_report(void);
+#endif
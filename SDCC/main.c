@@ -5,7 +5,7 @@
 // For the Small Device C Compiler (SDCC)
 //
 // UART1 used for debugging, monitor and in-application-programming - 115200bps N-8-1
-// UART2 used for communications with host PC - 9600bps N-8-1
+// UART2 used for communications with host PC - 9600bps (default) to 230400bps N-8-1
 // UART3 used for communications with Wheelwriter Function Board
 // UART4 used for communications with Wheelwriter Printer Board
 //
@@ -19,6 +19,31 @@
 // Version 1.3.3 - revised wheelwriter.c for ASCII Printwheel (part no. 1353909)
 // Version 1.3.4 - use UART1 for debugging and monitor
 // Version 1.3.5 - SDCC version
+// Version 1.4.0 - queued, interrupt-driven transmit to the Printer Board
+// Version 1.4.1 - spaces, tabs and backspaces coalesced into one carrier move
+// Version 1.4.2 - consecutive vertical movements coalesced into fewer paper feeds
+// Version 1.4.3 - optional line-buffered bidirectional printing
+// Version 1.4.4 - optional strike order optimized for printwheel rotation and carrier travel
+// Version 1.4.5 - underlining struck in one pass per line
+// Version 1.4.6 - optional grouping of superscripts and subscripts by baseline
+// Version 1.4.7 - Printer Board acknowledge timeout, retries and offline state
+// Version 1.4.8 - Printer Board replies processed after initialization, printer status
+// Version 1.4.9 - host flow control from the predicted time to finish the queued printing
+// Version 1.5.0 - 2K byte spool buffer for the host serial port
+// Version 1.5.1 - selectable host baud rate up to 230400bps, measured or kept in the IAP flash
+// Version 1.5.2 - buffered, interrupt-driven transmit to the host that honors CTS
+// Version 1.5.3 - optional XON/XOFF handshaking with the host
+// Version 1.5.4 - optional framed host protocol with sequence numbers, CRC and acknowledgements
+// Version 1.5.5 - status report to the host on ENQ
+// Version 1.5.6 - optional ETX/ACK pacing of the host
+// Version 1.5.7 - optional compressed host input with runs and copies from a 256 character window
+// Version 1.6.0 - raw Printer Board commands from the host
+// Version 1.6.1 - optional cooked keys, edited locally and sent to the host a line at a time
+// Version 1.6.2 - the Function Board is acknowledged by the UART3 ISR
+// Version 1.6.3 - larger Function Board receive buffer, overflow counts and acknowledge backpressure
+// Version 1.6.4 - optional relay of the Function Board straight to the Printer Board in local mode
+// Version 1.6.5 - Code key table and keymaps loadable into the IAP flash
+// Version 1.6.6 - keystroke to Printer Board latency statistics on the monitor
 // NOTE: When using STCmicro's stc-isp application to download object code to the MCU,
 //       make sure the internal clock frequency is set to 12 MHz.
 //
@@ -33,6 +58,9 @@
 #include "control.h"
 #include "uart1.h"
 #include "uart2.h"
+#include "eeprom.h"
+#include "host.h"
+#include "latency.h"
 #include "ww-uart3.h"
 #include "ww-uart4.h"
 #include "wheelwriter.h"
@@ -50,6 +78,12 @@
 #define RELOADLO (65536-50000)&255
 #define ONESEC 20                       // 20*50 milliseconds = 1 second
 
+#define PACEHIGH 2000                   // pause the host when the printer has more than 2 seconds of work queued or in the line buffer
+#define PACELOW 500                     // resume when it's down to half a second
+
+#define SETTINGSVALID 0x5A              // first byte of the settings sector once the settings have been saved
+#define AUTOSPEED 0xFF                  // hostSpeed value that measures the host's baud rate
+
 __sbit __at (0x85) redLED;              // red   LED connected to pin 6 0=on, 1=off
 __sbit __at (0x86) amberLED;            // amber LED connected to pin 7 0=on, 1=off
 __sbit __at (0x87) greenLED;            // green LED connected to pin 8 0=on, 1=off
@@ -59,32 +93,66 @@ __bit autoCarriageReturn = FALSE;       // when true, automatically print a carr
 __bit errorLED = FALSE;                 // makes the red LED flash when TRUE
 __bit initializing = TRUE;              // makes all three LEDs flash during initialization
 __bit monitor = FALSE;                  // monitor communications between function and printer boards
+__bit printwheelPresent = TRUE;         // false when the Printer Board reports no printwheel
+__bit idRequested = FALSE;              // set while waiting for the Printer Board's reply to 0x121,0x001
 __bit localMode = TRUE;                 // when true wheelwriter keystrokes go to wheelwriter, when false wheelwriter keystrokes go to serial console
+__bit bidirectional = FALSE;            // when true, each line is buffered and printed left to right or right to left, whichever is nearer
+__bit optimizeStrikes = FALSE;          // when true, each line is buffered and printed in the order that needs the least printwheel rotation and carrier travel
+__bit xonXoff = FALSE;                  // when true, XON/XOFF handshaking with the host instead of RTS/CTS
+__bit relayMode = FALSE;                // when true, keys in local mode are relayed straight from the Function Board to the Printer Board
+__bit relaying = FALSE;                 // relayMode in local mode, words are being relayed
+__bit groupBaselines = FALSE;           // when true, each line is buffered and superscripts and subscripts are printed one baseline at a time
+__bit pacing = TRUE;                    // when true, the host is paused while the printer has plenty of work (PACEHIGH)
+__bit hostPaced = FALSE;                // pacing is pausing the host
 
 unsigned char attribute = 0;            // bit 0=bold, bit 1=continuous underline, bit 2=multiple word underline
 unsigned char column = 1;               // current print column (1=left margin)
 unsigned char tabStop = 5;              // horizontal tabs every 5 spaces (every 1/2 inch)
 unsigned char printWheel = 0;           // 10pt, 12pt, 15pt or PS
+unsigned int lastReply = 0;             // last reply from the Printer Board
+unsigned int replyLatency = 0;          // milliseconds between asking for the printwheel ID and the reply
+unsigned int requestTime;               // when the printwheel ID was asked for
+unsigned char hostSpeed = 0;            // index of the host's baud rate in baudRates[], or AUTOSPEED
+unsigned char etxMode = ETXOFF;         // ETX/ACK pacing: ETXOFF, ETXPRINTED or ETXSPOOLED
+unsigned char etxBlocks = 2;            // the host's ETX/ACK block size in 128 character units
 
 extern unsigned char uSpacesPerChar;    // micro spaces per character; defined in wheelwriter.c
 extern unsigned char uLinesPerLine;     // micro lines per line; defined in wheelwriter.c
 extern unsigned int  uSpaceCount;       // number of micro spaces on the current line; defined in wheelwriter.c
+extern __xdata long rotationSaved;      // printwheel rotation saved by optimized strike order; defined in wheelwriter.c
+extern __xdata unsigned int linesOptimized; // baselines printed in optimized strike order; defined in wheelwriter.c
+extern volatile unsigned char ackTimer; // deadline for the Printer Board's acknowledge; defined in ww-uart4.c
+extern volatile unsigned char relayTimer; // deadline for the Printer Board's reply to a relayed word; defined in ww-uart3.c
+extern __xdata unsigned int ackTimeouts; // acknowledges that missed the deadline; defined in ww-uart4.c
+extern __xdata unsigned int offlineEvents; // times the Printer Board has gone offline; defined in ww-uart4.c
+extern __xdata unsigned int rx2_overflows; // characters lost from the host; defined in uart2.c
+extern __xdata unsigned int tx2_overflows; // characters lost to the host; defined in uart2.c
+extern __xdata unsigned int framesGood; // frames printed; defined in host.c
+extern __xdata unsigned int framesBad; // frames with a bad length or CRC; defined in host.c
+extern __xdata unsigned int rawErrors; // raw commands not sent to the Printer Board; defined in wheelwriter.c
+extern __xdata unsigned int rx3_overflows; // words lost from the Function Board; defined in ww-uart3.c
+extern __xdata unsigned int rx3_holds; // acknowledges withheld from the Function Board; defined in ww-uart3.c
+extern __bit keymap;                    // keys are decoded with the loaded keymap; defined in wheelwriter.c
 
+volatile unsigned int tickCount = 0;    // incremented every 50 milliseconds
+volatile unsigned char hostIdle = 0;    // decremented every 50 milliseconds, counts down the time the host has been quiet
 volatile unsigned char timeout = 0;     // decremented every 50 milliseconds, used for detecting timeouts
 volatile unsigned char hours = 0;       // uptime hours
 volatile unsigned char minutes = 0;     // uptime minutes
 volatile unsigned char seconds = 0;     // uptime seconds
 
-// uninitialized variables in xdata RAM, contents unaffected by reset
+// uninitialized variables in xdata RAM, contents unaffected by reset. the rest of xdata must
+// stay below 0xEF0, which build.bat has the linker check with --xram-size
 volatile __xdata __at (0xEF0) unsigned char wdResets;
 volatile __xdata __at (0xEF1) unsigned char softResetFlag;
 
-__code char about[] = "Wheelwriter Teletype Version 1.3.5\n"
+__code char about[] = "Wheelwriter Teletype Version 1.6.6\n"
                       "for STCmicro IAP15W4K61S4 MCU and SDCC Compiler\n"
                       "Compiled on " __DATE__ " at " __TIME__"\n"
                       "Copyright 2019-2024 Jim Loos\n";
 
 __code char help1[] = "\n\nControl characters:\n"
+                      "  ENQ 0x05        sends the status report to the host\n"
                       "  BEL 0x07        spins the printwheel\n"
                       "  BS  0x08        non-destructive backspace\n"
                       "  TAB 0x09        horizontal tab\n"
@@ -109,11 +177,27 @@ __code char help2[] = "\n\nPrinter control not part of the Diablo 630 emulation:
                       "  <ESC><b>        selects broken underlining\n"
                       "  <ESC><l><n>     auto linefeed on or off\n"
                       "  <ESC><c><n>     auto carriage return on or off\n"
+                      "  <ESC><i><n>     bidirectional printing on or off\n"
+                      "  <ESC><o><n>     optimized strike order on or off\n"
+                      "  <ESC><g><n>     group superscripts and subscripts on or off\n"
                       "  <ESC><p>        selects Pica pitch\n"
                       "  <ESC><e>        selects Elite pitch\n"
                       "  <ESC><m>        selects Micro Elite pitch\n"
+                      "  <ESC><s><n>     host baud rate 9600-230400 (n=0-5) or measured (n=a)\n"
+                      "  <ESC><h><n>     XON/XOFF handshaking on or off\n"
+                      "  <ESC><f><n>     framed host protocol on or off (RTS/CTS only)\n"
+                      "  <ESC><z><n>     compressed host input on or off\n"
+                      "  <ESC><r><n>     raw Printer Board commands from the host on or off\n"
+                      "  <ESC><k><n>     cooked (line at a time) keys in line mode on or off\n"
+                      "  <ESC><t><n>     relay keys straight to the Printer Board in local mode on or off\n"
+                      "  <ESC><y><n>     keys decoded with the loaded keymap on or off\n"
+                      "  <ESC><Y>...     load a keymap of 224 bytes in hex and a checksum, see wheelwriter.c\n"
+                      "  <ESC><w><n>     pause the host while the printer has 2 seconds of work on or off\n"
+                      "  <ESC><a><n><m> ETX/ACK off (n=0), ACK when printed (n=1) or spooled (n=2),\n"
+                      "                  blocks of m*128 characters (m=1-8)\n"
                       "\nDiagnostics/debugging:\n"
                       "  <ESC><^Z><a>    show version information\n"
+                      "  <ESC><^Z><k>    show keystroke latencies\n"
                       "  <ESC><^Z><l><n> turn flashing red error LED on or off\n"
                       "  <ESC><^Z><m>    monitor Function Board commands\n"
                       "  <ESC><^Z><p><n> show value of Port n (0-5)\n"
@@ -144,10 +228,24 @@ int putchar(int c)  {
 void timer0_isr(void) __interrupt(1) __using(1) {
     static unsigned char ticks = 0;
 
+    ++tickCount;                    // 50 milliseconds have elapsed
+
+    if (hostIdle) {                 // countdown value for detecting host idle time
+        --hostIdle;
+    }
+
     if (timeout) {                  // countdown value for detecting timeouts
         --timeout;
     }
 
+    if (ackTimer) {                 // countdown value for the Printer Board's acknowledge
+        --ackTimer;
+    }
+
+    if (relayTimer) {                 // countdown value for the Printer Board's reply to a relayed word
+        --relayTimer;
+    }
+
     if (initializing) {             // flash all three LEDs at 2Hz while initializing
        amberLED = greenLED = redLED = (ticks < 10);
     }
@@ -169,6 +267,54 @@ void timer0_isr(void) __interrupt(1) __using(1) {
     }
 }
 
+//------------------------------------------------------------------------------------------
+// Settings kept in the IAP flash when the power is off. The valid marker is written last
+// so that a reset while saving leaves the defaults instead of half written settings.
+//------------------------------------------------------------------------------------------
+void load_settings(void) {
+    if (eeprom_read(SETTINGSADDR) == SETTINGSVALID) {
+        hostSpeed = eeprom_read(SETTINGSADDR+1);
+        xonXoff = (eeprom_read(SETTINGSADDR+2) == 1);
+        etxMode = eeprom_read(SETTINGSADDR+3);
+        etxBlocks = eeprom_read(SETTINGSADDR+4);
+        relayMode = (eeprom_read(SETTINGSADDR+5) == 1);
+        ww_keymap(eeprom_read(SETTINGSADDR+6) == 1);
+        pacing = (eeprom_read(SETTINGSADDR+7) == 1);
+        if ((hostSpeed >= BAUDRATES) && (hostSpeed != AUTOSPEED))
+            hostSpeed = 0;                                  // 9600bps
+        if (etxMode > ETXSPOOLED)
+            etxMode = ETXOFF;
+        if ((etxBlocks < 1) || (etxBlocks > 8))
+            etxBlocks = 2;                                  // 256 characters
+    }
+}
+
+void save_settings(void) {
+    eeprom_erase(SETTINGSADDR);
+    eeprom_write(SETTINGSADDR+1,hostSpeed);
+    eeprom_write(SETTINGSADDR+2,xonXoff);
+    eeprom_write(SETTINGSADDR+3,etxMode);
+    eeprom_write(SETTINGSADDR+4,etxBlocks);
+    eeprom_write(SETTINGSADDR+5,relayMode);
+    eeprom_write(SETTINGSADDR+6,keymap);
+    eeprom_write(SETTINGSADDR+7,pacing);
+    eeprom_write(SETTINGSADDR,SETTINGSVALID);
+}
+
+//------------------------------------------------------------------------------------------
+// Relays the Function Board straight to the Printer Board when relay mode is selected and
+// the Wheelwriter is in local mode. Anything queued for the Printer Board goes first.
+// Characters from the host wait while relaying.
+//------------------------------------------------------------------------------------------
+void update_relay(void) {
+    relaying = relayMode && localMode;
+    if (relaying) {
+        ww_flush();
+        printer_board_drain();                              // the relayed words need UART4 to themselves
+    }
+    function_board_relay(relaying);
+}
+
 //------------------------------------------------------------------------------------------
 // The Wheelwriter prints the character and updates the variable 'column'.
 // Carriage return cancels bold and underlining and resets 'column' back to 1.
@@ -176,6 +322,8 @@ void timer0_isr(void) __interrupt(1) __using(1) {
 // The character printed by the Wheelwriter is echoed to the serial port (for monitoring).
 //
 // Control characters:
+//   ETX 0x03    with ETX/ACK pacing, the end of a block the host wants acknowledged (see host.c)
+//   ENQ 0x05    the host's status request, answered from the main loop (see host.c)
 //   BEL 0x07    spins the printwheel
 //   BS  0x08    non-destructive backspace
 //   TAB 0x09    horizontal tab to next tab stop
@@ -201,14 +349,31 @@ void timer0_isr(void) __interrupt(1) __using(1) {
 //   <ESC><b>    selects broken underlining (spaces between words are not underlined)
 //   <ESC><l><n> auto linefeed (n=1 is on, n=0 is off)
 //   <ESC><c><n> auto carriage return (n=1 is on, n=0 is off)
+//   <ESC><i><n> bidirectional printing (n=1 is on, n=0 is off)
+//   <ESC><o><n> optimized strike order (n=1 is on, n=0 is off)
+//   <ESC><g><n> superscripts and subscripts grouped by baseline (n=1 is on, n=0 is off)
 //   <ESC><p>    selects Pica pitch (10 characters/inch or 12 point)
 //   <ESC><e>    selects Elite pitch (12 characters/inch or 10 point)
 //   <ESC><m>    selects Micro Elite pitch (15 characters/inch or 8 point)
+//   <ESC><s><n> host baud rate (n=0-5 for 9600,19200,38400,57600,115200,230400bps, n=a measures it)
+//   <ESC><h><n> XON/XOFF handshaking with the host instead of RTS/CTS (n=1 is on, n=0 is off)
+//   <ESC><f><n> frames with sequence numbers and a CRC from the host, see host.c (n=1 is on, n=0 is off, refused with XON/XOFF)
+//   <ESC><w><n> pause the host while the printer has more than PACEHIGH milliseconds of work (n=1 is on, n=0 is off)
+//   <ESC><a><n><m> ETX/ACK pacing (n=0 is off, n=1 ACKs printed blocks, n=2 ACKs spooled blocks of m*128 characters)
+//   <ESC><z><n> compressed characters from the host, see host.c (n=1 is on, n=0 is off)
+//   <ESC><r><n> raw Printer Board commands from the host, see wheelwriter.c (n=1 is on, n=0 is off)
+//   <ESC><k><n> keys typed in line mode are edited locally and sent a line at a time, see host.c (n=1 is on, n=0 is off)
+//   <ESC><t><n> in local mode, relay the Function Board straight to the Printer Board (n=1 is on, n=0 is off)
+//   <ESC><y><n> keys are decoded with the keymap loaded into the IAP flash, see wheelwriter.c (n=1 is on, n=0 is off)
+//   <ESC><Y>    the 224 bytes in hex and the checksum that follow are loaded into the IAP flash as the keymap, see wheelwriter.c
 //-------------------------------------------------------------------------------------------
 void print_char_on_WW(unsigned char charToPrint) {
     static unsigned char escape = 0;                        // escape sequence state
     unsigned char i,t;
 
+    if ((escape == 17) && ww_keymap_late())                 // the host gave up in the middle of a keymap...
+        escape = 0;                                         // ...so this character is handled as usual
+
     switch(escape) {
         case 0:                                             // first character
             switch(charToPrint) {
@@ -298,7 +463,14 @@ void print_char_on_WW(unsigned char charToPrint) {
                 case 'c':
                     escape = 3;                             // <ESC><c> selects auto carriage return, the next character turns it on or off
                     break;
+                case 'g':
+                    escape = 6;                             // <ESC><g> selects baseline grouping, the next character turns it on or off
+                    break;
+                case 'i':
+                    escape = 4;                             // <ESC><i> selects bidirectional printing, the next character turns it on or off
+                    break;
                 case 'e':                                   // <ESC><e> selects Elite (12 characters/inch)
+                    ww_print_line();                        // the buffered line is printed at the pitch it was typed in
                     uSpacesPerChar = 10;                    // 10 micro spaces/character
                     uLinesPerLine = 16;                     // 16 micro lines/full line
                     tabStop = 6;                            // tab stops every 6 characters (every 1/2 inch)
@@ -307,11 +479,50 @@ void print_char_on_WW(unsigned char charToPrint) {
                     escape = 2;
                     break;
                 case 'p':                                   // <ESC><p> selects Pica (10 characters/inch)
+                    ww_print_line();                        // the buffered line is printed at the pitch it was typed in
                     uSpacesPerChar = 12;                    // 10 micro spaces/character
                     uLinesPerLine = 16;                     // 16 micro lines/full line
                     tabStop = 5;                            // tab stops every 5 characters (every 1/2 inch)
                     break;
+                case 'o':
+                    escape = 5;                             // <ESC><o> selects optimized strike order, the next character turns it on or off
+                    break;
+                case 'a':
+                    escape = 10;                            // <ESC><a> selects ETX/ACK pacing, the next two characters are the mode and the block size
+                    break;
+                case 'f':
+                    escape = 9;                             // <ESC><f> selects the framed host protocol, the next character turns it on or off
+                    break;
+                case 'z':
+                    escape = 12;                            // <ESC><z> selects compressed host input, the next character turns it on or off
+                    break;
+                case 'r':
+                    escape = 13;                            // <ESC><r> selects raw Printer Board commands, the next character turns them on or off
+                    break;
+                case 'k':
+                    escape = 14;                            // <ESC><k> selects cooked keys, the next character turns them on or off
+                    break;
+                case 't':
+                    escape = 15;                            // <ESC><t> selects relay mode, the next character turns it on or off
+                    break;
+                case 'y':
+                    escape = 16;                            // <ESC><y> selects the keymap, the next character turns the loaded one on or off
+                    break;
+                case 'Y':
+                    ww_keymap_start();
+                    escape = 17;                            // <ESC><Y> loads a keymap, the hex digits that follow are the keymap
+                    break;
+                case 'w':
+                    escape = 18;                            // <ESC><w> selects pacing by the printer's work, the next character turns it on or off
+                    break;
+                case 'h':
+                    escape = 8;                             // <ESC><h> selects XON/XOFF handshaking, the next character turns it on or off
+                    break;
+                case 's':
+                    escape = 7;                             // <ESC><s> selects the host baud rate, the next character is the rate
+                    break;
                 case 'm':                                   // <ESC><m> selects Micro Elite (15 characters/inch)
+                    ww_print_line();                        // the buffered line is printed at the pitch it was typed in
                     uSpacesPerChar = 8;                     // 10 micro spaces/character
                     uLinesPerLine = 12;                     // 16 micro lines/full line
                     tabStop = 7;                            // tab stops every 7 characters (every 1/2 inch)
@@ -338,9 +549,185 @@ void print_char_on_WW(unsigned char charToPrint) {
             else
                 autoCarriageReturn = FALSE;
             break; // case 3
+        case 4:                                             // <ESC><i><n> has been detected. this is the third character of the escape sequence
+            escape = 0;
+            if (charToPrint & 0x01)
+                bidirectional = TRUE;                       // <ESC><i><n> odd values of n turn bidirectional printing on, even values turn it off
+            else {
+                ww_print_line();                            // print whatever is buffered before going back to printing as received
+                bidirectional = FALSE;
+            }
+            break; // case 4
+        case 5:                                             // <ESC><o><n> has been detected. this is the third character of the escape sequence
+            escape = 0;
+            if (charToPrint & 0x01)
+                optimizeStrikes = TRUE;                     // <ESC><o><n> odd values of n turn optimized strike order on, even values turn it off
+            else {
+                ww_print_line();                            // print whatever is buffered before going back to printing as received
+                optimizeStrikes = FALSE;
+            }
+            break; // case 5
+        case 6:                                             // <ESC><g><n> has been detected. this is the third character of the escape sequence
+            escape = 0;
+            if (charToPrint & 0x01)
+                groupBaselines = TRUE;                      // <ESC><g><n> odd values of n turn baseline grouping on, even values turn it off
+            else {
+                ww_print_line();                            // print whatever is buffered before going back to printing as received
+                groupBaselines = FALSE;
+            }
+            break; // case 6
+        case 7:                                             // <ESC><s><n> has been detected. this is the third character of the escape sequence
+            escape = 0;
+            if ((charToPrint >= '0') && (charToPrint < '0'+BAUDRATES))
+                hostSpeed = charToPrint-'0';                // <ESC><s><n> n=0-5 selects 9600,19200,38400,57600,115200 or 230400bps
+            else if (toupper(charToPrint) == 'A')
+                hostSpeed = AUTOSPEED;                      // <ESC><s><a> measures the rate from the next character the host sends
+            else
+                break;
+            save_settings();                                // keep the rate when the power is off
+            uart2_baudrate((hostSpeed == AUTOSPEED) ? AUTOBAUD : baudRates[hostSpeed]);
+            break; // case 7
+        case 8:                                             // <ESC><h><n> has been detected. this is the third character of the escape sequence
+            escape = 0;
+            xonXoff = charToPrint & 0x01;                   // <ESC><h><n> odd values of n turn XON/XOFF on, even values turn it off
+            save_settings();                                // keep the handshaking when the power is off
+            uart2_handshake(xonXoff);
+            if (xonXoff)
+                host_framing(FALSE);                        // frames can hold XON and XOFF, see host.c
+            break; // case 8
+        case 9:                                             // <ESC><f><n> has been detected. this is the third character of the escape sequence
+            escape = 0;
+            host_framing((charToPrint & 0x01) && !xonXoff); // <ESC><f><n> odd values of n turn framing on, even values turn it off
+            break; // case 9
+        case 10:                                            // <ESC><a><n> has been detected. this is the third character of the escape sequence
+            escape = 11;
+            etxMode = charToPrint-'0';                      // <ESC><a><n> n=0 is off, n=1 ACKs printed blocks, n=2 ACKs spooled blocks
+            if (etxMode > ETXSPOOLED)
+                etxMode = ETXOFF;
+            break; // case 10
+        case 11:                                            // <ESC><a><n><m> has been detected. this is the fourth character of the escape sequence
+            escape = 0;
+            if ((charToPrint >= '1') && (charToPrint <= '8'))
+                etxBlocks = charToPrint-'0';                // <ESC><a><n><m> blocks of m*128 characters
+            save_settings();                                // keep ETX/ACK pacing when the power is off
+            host_etx(etxMode,etxBlocks*128);
+            break; // case 11
+        case 12:                                            // <ESC><z><n> has been detected. this is the third character of the escape sequence
+            escape = 0;
+            host_compression(charToPrint & 0x01);           // <ESC><z><n> odd values of n turn compressed input on, even values turn it off
+            break; // case 12
+        case 13:                                            // <ESC><r><n> has been detected. this is the third character of the escape sequence
+            escape = 0;
+            host_raw(charToPrint & 0x01);                   // <ESC><r><n> odd values of n turn raw mode on, even values turn it off
+            break; // case 13
+        case 14:                                            // <ESC><k><n> has been detected. this is the third character of the escape sequence
+            escape = 0;
+            host_cooking(charToPrint & 0x01);               // <ESC><k><n> odd values of n turn cooked keys on, even values turn them off
+            break; // case 14
+        case 15:                                            // <ESC><t><n> has been detected. this is the third character of the escape sequence
+            escape = 0;
+            relayMode = charToPrint & 0x01;                 // <ESC><t><n> odd values of n turn relay mode on, even values turn it off
+            save_settings();                                // keep relay mode when the power is off
+            update_relay();
+            break; // case 15
+        case 16:                                            // <ESC><y><n> has been detected. this is the third character of the escape sequence
+            escape = 0;
+            ww_keymap(charToPrint & 0x01);                  // <ESC><y><n> odd values of n select the loaded keymap, even values the built-in one
+            save_settings();                                // keep the selection when the power is off
+            break; // case 16
+        case 17:                                            // <ESC><Y> has been detected. the characters that follow are the keymap
+            if (!ww_keymap_load(charToPrint))
+                escape = 0;                                 // the keymap has been loaded or abandoned
+            break; // case 17
+        case 18:                                            // <ESC><w><n> has been detected. this is the third character of the escape sequence
+            escape = 0;
+            pacing = charToPrint & 0x01;                    // <ESC><w><n> odd values of n turn pacing on, even values turn it off
+            save_settings();                                // keep pacing when the power is off
+            break; // case 18
     } // switch(escape)
 }
 
+//------------------------------------------------------------------------------------------
+// Sets the pitch for the printwheel ID that the Printer Board replies with to 0x121,0x001
+//------------------------------------------------------------------------------------------
+void set_printwheel(unsigned char wheel) {
+    ww_print_line();                                        // the buffered line is printed at the old pitch
+    printWheel = wheel;
+    printwheelPresent = TRUE;
+    switch(printWheel) {
+       case 0x008:
+          printf("\nPS printwheel\n");
+          tabStop = 5;                                      // tab stops every 5 characters (every 1/2 inch)
+          uSpacesPerChar = 10;                              // 10 micro spaces/character
+          uLinesPerLine = 16;                               // 16 micro lines/full line
+          break;
+       case 0x010:
+          printf("\n15P printwheel\n");
+          tabStop = 7;                                      // tab stops every 7 characters (every 1/2 inch)
+          uSpacesPerChar = 8;
+          uLinesPerLine = 12;
+          break;
+       case 0x020:
+          printf("\n12P printwheel\n");
+          tabStop = 6;                                      // tab stops every 6 characters (every 1/2 inch)
+          uSpacesPerChar = 10;                              // 10 micro spaces/character
+          uLinesPerLine = 16;                               // 16 micro lines/full line
+          break;
+       case 0x021:
+          printf("\nNo printwheel\n");
+          printwheelPresent = FALSE;
+          tabStop = 6;                                      // tab stops every 6 characters (every 1/2 inch)
+          uSpacesPerChar = 10;                              // 10 micro spaces/character
+          uLinesPerLine = 16;                               // 16 micro lines/full line
+          break;
+       case 0x040:
+          printf("\n10P printwheel\n");
+          tabStop = 5;                                      // tab stops every 5 characters (every 1/2 inch)
+          uSpacesPerChar = 12;                              // 10 micro spaces/character
+          uLinesPerLine = 16;                               // 16 micro lines/full line
+          break;
+       default:
+          printf("\nUnable to determine printwheel. Defaulting to 12P.\n");
+          printf("0x%02X\n",(int)printWheel);
+          tabStop = 6;                                      // tab stops every 6 characters (every 1/2 inch)
+          uSpacesPerChar = 10;                              // 10 micro spaces/character
+          uLinesPerLine = 16;                               // 16 micro lines/full line
+          errorLED=TRUE;
+    } // switch(printWheel)
+}
+
+//------------------------------------------------------------------------------------------
+// Returns milliseconds from timer 0: the 50 millisecond ticks plus the microseconds
+// counted so far in the current tick. Rolls over every 65.536 seconds.
+//------------------------------------------------------------------------------------------
+unsigned int milliseconds(void) {
+    unsigned int t;
+    unsigned char hi,lo;
+
+    do {
+        t = tickCount;
+        hi = TH0;
+        lo = TL0;
+    } while ((hi != TH0) || (t != tickCount)); // read again if timer 0 moved on while reading
+    return t*50+((((unsigned int)hi<<8)|lo)-(unsigned int)(65536-50000))/1000;
+}
+
+//------------------------------------------------------------------------------------------
+// Keeps the Printer Board status up to date from its replies. Acknowledges are taken by
+// the UART4 ISR, so what arrives here is the printwheel ID after 0x121,0x001 or a late
+// acknowledge after a retry.
+//------------------------------------------------------------------------------------------
+void printer_board_status(unsigned int reply) {
+    lastReply = reply;
+    if (idRequested) {                                      // if the Function Board asked for the printwheel ID...
+        idRequested = FALSE;
+        replyLatency = milliseconds()-requestTime;
+        if (!relaying)
+            send_to_function_board(reply);                  // ...pass the answer back to it (relayed, the UART4 ISR already has)
+        set_printwheel(reply);                              // the printwheel may have been changed
+    }
+}
+
 #define PATTERN " %c%c%c%c%c%c%c%c\n"
 #define TO_BINARY(byte)  \
   (byte & 0x80 ? '1' : '0'), \
@@ -358,6 +745,7 @@ void print_char_on_WW(unsigned char charToPrint) {
 // for diagnostics/debugging:
 //   <ESC><h>        display help
 //   <ESC><^Z><a>    show version information
+//   <ESC><^Z><k>    show keystroke latencies since they were last shown, see latency.c
 //   <ESC><^Z><l><n> turn flashing red error LED on or off (n=1 is on, n=0 is off)
 //   <ESC><^Z><m>    monitor Function Board commands
 //   <ESC><^Z><p><n> show the value of Port n (0-5) as 2 digit hex number
@@ -399,6 +787,11 @@ void process_key(unsigned char key) {
                   printf("\n%s\n",about);
                   for(c=1; c<column; c++) putchar(SP);      // return cursor to previous position on line
                   break;
+               case 'K':
+               case 'k':                                    // <ESC><^Z><k> print keystroke latencies
+                  latency_report();
+                  for(c=1; c<column; c++) putchar(SP);      // return cursor to previous position on line
+                  break;
                case 'L':
                case 'l':                                    // <ESC><^Z><l> controls the red error LED. the next character turn is on or off
                   escape = 4;
@@ -430,10 +823,36 @@ void process_key(unsigned char key) {
                   printf("%s %s\n",    "initializing:      ",initializing?"true":"false");
                   printf("%s %s\n",    "monitor:           ",monitor?"true":"false");
                   printf("%s %s\n",    "localMode:         ",localMode?"true":"false");
+                  printf("%s %s\n",    "relayMode:         ",relayMode?"true":"false");
+                  printf("%s %s\n",    "keymap:            ",keymap?"loaded":"built-in");
+                  printf("%s %s\n",    "bidirectional:     ",bidirectional?"true":"false");
+                  printf("%s %s\n",    "optimizeStrikes:   ",optimizeStrikes?"true":"false");
+                  printf("%s %s\n",    "groupBaselines:    ",groupBaselines?"true":"false");
+                  printf("%s %s\n",    "pacing:            ",pacing?"true":"false");
+                  printf("%s %d\n",    "hostSpeed:         ",(int)hostSpeed);
+                  printf("%s %s\n",    "xonXoff:           ",xonXoff?"true":"false");
+                  printf("%s %d\n",    "etxMode:           ",(int)etxMode);
+                  printf("%s %d\n",    "etxBlocks:         ",(int)etxBlocks);
+                  printf("%s %u\n",    "linesOptimized:    ",linesOptimized);
+                  printf("%s %ld\n",   "rotationSaved:     ",rotationSaved);
+                  printf("%s %s\n",    "printerOffline:    ",printer_board_offline()?"true":"false");
+                  printf("%s %u\n",    "ackTimeouts:       ",ackTimeouts);
+                  printf("%s %u\n",    "offlineEvents:     ",offlineEvents);
+                  printf("%s %u\n",    "rx2Overflows:      ",rx2_overflows);
+                  printf("%s %u\n",    "tx2Overflows:      ",tx2_overflows);
+                  printf("%s %u\n",    "framesGood:        ",framesGood);
+                  printf("%s %u\n",    "framesBad:         ",framesBad);
+                  printf("%s %u\n",    "rawErrors:         ",rawErrors);
+                  printf("%s %u\n",    "rx3Overflows:      ",rx3_overflows);
+                  printf("%s %u\n",    "rx3Holds:          ",rx3_holds);
+                  printf("%s %u\n",    "drainTime:         ",ww_drain_time());
                   printf("%s" PATTERN, "attribute:         ",TO_BINARY(attribute));
                   printf("%s %d\n",    "column:            ",(int)column);
                   printf("%s %d\n",    "tabStop:           ",(int)tabStop);
                   printf("%s 0x%02X\n","printWheel:        ",(int)printWheel);
+                  printf("%s %s\n",    "printwheelPresent: ",printwheelPresent?"true":"false");
+                  printf("%s 0x%03X\n","lastReply:         ",lastReply);
+                  printf("%s %u\n",    "replyLatency:      ",replyLatency);
                   printf("%s %d\n",    "uSpacesPerChar:    ",(int)uSpacesPerChar);
                   printf("%s %d\n",    "uLinesPerLine:     ",(int)uLinesPerLine);
                   printf("%s %d\n",    "uSpaceCount:       ",(int)uSpaceCount);
@@ -495,10 +914,11 @@ void process_key(unsigned char key) {
 // main(void)
 //-----------------------------------------------------------
 void main(void){
-    unsigned int loopcounter,function_board_cmd,printer_board_reply;
+    unsigned int loopcounter,function_board_cmd,printer_board_reply,lastFunctionBoardCmd = 0;
     unsigned char state = 0;
     unsigned char wwKey,ch;
     unsigned char lastsec = 0;
+    unsigned long baud;
 
     // from the data sheet:
     // "After power-up, all PWM-related I/O ports on the IAP15W4K61S4 are in high impedance state.
@@ -513,7 +933,10 @@ void main(void){
     ET0 = 1;                                                // enable timer 0 interrupt
     TR0 = 1;                                                // run timer 0
     uart1_init(115200);                                     // initialize UART1 for N-8-1 at 115200bps for debug/monitor
-    uart2_init(9600);                                       // initialize UART2 for N-8-1 at 9600bps, RTS-CTS handshaking for host PC
+    load_settings();                                        // the host's baud rate is kept in the IAP flash
+    uart2_init((hostSpeed == AUTOSPEED) ? AUTOBAUD : baudRates[hostSpeed]);// initialize UART2 for N-8-1 for host PC
+    uart2_handshake(xonXoff);                               // RTS-CTS or XON-XOFF handshaking for host PC
+    host_etx(etxMode,etxBlocks*128);                        // ETX/ACK pacing for host PC
     uart3_init();                                           // initialize UART3 for N-9-1 at 187500bps for connection to the Function Board
     uart4_init();                                           // initialize UART4 for N-9-1 at 187500bps for connection to the Printer Board
 
@@ -570,46 +993,7 @@ void main(void){
             printer_board_reply = get_printer_board_reply();// retrieve the reply from UART4
             send_to_function_board(printer_board_reply);    // relay replies from the Printer Board to the Function Board
             if (state == 2) {                               // if the reset command has been sent, the reply from the printer board is the printwheel pitch
-               printWheel = printer_board_reply;            // we now know the pitch of the printwheel, exit the loop
-               switch(printWheel) {
-                  case 0x008:
-                     printf("\nPS printwheel\n");
-                     tabStop = 5;                           // tab stops every 5 characters (every 1/2 inch)
-                     uSpacesPerChar = 10;                   // 10 micro spaces/character
-                     uLinesPerLine = 16;                    // 16 micro lines/full line
-                     break;
-                  case 0x010:
-                     printf("\n15P printwheel\n");
-                     tabStop = 7;                           // tab stops every 7 characters (every 1/2 inch)
-                     uSpacesPerChar = 8;
-                     uLinesPerLine = 12;
-                     break;
-                  case 0x020:
-                     printf("\n12P printwheel\n");
-                     tabStop = 6;                           // tab stops every 6 characters (every 1/2 inch)
-                     uSpacesPerChar = 10;                   // 10 micro spaces/character
-                     uLinesPerLine = 16;                    // 16 micro lines/full line
-                     break;
-                  case 0x021:
-                     printf("\nNo printwheel\n");
-                     tabStop = 6;                           // tab stops every 6 characters (every 1/2 inch)
-                     uSpacesPerChar = 10;                   // 10 micro spaces/character
-                     uLinesPerLine = 16;                    // 16 micro lines/full line
-                     break;
-                  case 0x040:
-                     printf("\n10P printwheel\n");
-                     tabStop = 5;                           // tab stops every 5 characters (every 1/2 inch)
-                     uSpacesPerChar = 12;                   // 10 micro spaces/character
-                     uLinesPerLine = 16;                    // 16 micro lines/full line
-                     break;
-                  default:
-                     printf("\nUnable to determine printwheel. Defaulting to 12P.\n");
-                     printf("0x%02X\n",(int)printWheel);
-                     tabStop = 6;                           // tab stops every 6 characters (every 1/2 inch)
-                     uSpacesPerChar = 10;                   // 10 micro spaces/character
-                     uLinesPerLine = 16;                    // 16 micro lines/full line
-                     errorLED=TRUE;
-               } // switch(printWheel)
+               set_printwheel(printer_board_reply);         // we now know the pitch of the printwheel, exit the loop
             } // if (state == 2)
         } // if (printer_board_reply_avail())
     } // while(!printWheel)
@@ -638,6 +1022,8 @@ void main(void){
     printf("<ESC> H for help\n");
     printf("Ready\n");
     initializing = FALSE;
+    function_board_acks(TRUE);                              // the UART3 ISR acknowledges the Function Board from now on
+    update_relay();                                         // or relays it to the Printer Board
     amberLED = OFF;                                         // turn off the amber LED
     greenLED = OFF;                                         // turn off the green LED
     redLED = OFF;                                           // turn off the red LED
@@ -647,6 +1033,27 @@ void main(void){
     while(TRUE) {
 
         RESET_WDT;                                              // reset the watch dog timer each pass thru the loop
+        printer_board_check();                                  // retry or report a Printer Board that isn't acknowledging
+        function_board_check();                                 // acknowledge a relayed word the Printer Board hasn't answered
+        uart2_check();                                          // resume sending to the host once CTS is low again
+        if (uart2_enquired())                                   // if the host has sent ENQ...
+            host_status();                                      // answer with the status report right away
+        host_check();                                           // ACK blocks from the host that have been printed or spooled
+        latency_check();                                        // record the times of the key being timed once it's been printed
+
+        //////////// pace the host by the predicted time to finish the queued printing ////////////
+        // once the Printer Board has caught up the host is let go even if the line buffer is full,
+        // so that the idle flush below can print the line that's holding things up
+        if (!pacing || printer_board_idle() || (ww_drain_time() < PACELOW))
+            hostPaced = FALSE;                                  // RTS follows the receive buffer again
+        else if (ww_drain_time() > PACEHIGH)
+            hostPaced = TRUE;                                   // RTS high, the printer has plenty to do
+        uart2_hold(HOLD_PACING,hostPaced);
+
+        //////////// measure the host's baud rate from its first character ////////////
+        baud = uart2_autobaud();                                // returns AUTOBAUD until the rate is known
+        if (baud != AUTOBAUD)
+            printf("Host baud rate %lu\n",baud);
 
         if (++loopcounter==0) {                                 // every 65536 passes through the loop (at about 2Hz)
             greenLED = !greenLED;                               // toggle the green "heart beat" LED
@@ -655,32 +1062,60 @@ void main(void){
         //////////// check for key press codes coming from the Function Board ////////////
         if (function_board_cmd_avail()) {                       // if there's a command from the Function Board...
             function_board_cmd = get_function_board_cmd();      // retrieve it from UART3
-            send_ACK_to_function_board();                       // mimic Printer Board by sending Acknowledge to Function Board
             if (monitor) printf("%03X\n",function_board_cmd);   // if the monitor flag is set...
+            if (function_board_cmd == 0x121) latency_key();     // the start of a key, see latency.c
+            if ((function_board_cmd == 0x001) && (lastFunctionBoardCmd == 0x121)) {// 0x121,0x001 asks for the printwheel ID...
+                if (!relaying) {                                // ...pass the question on to the Printer Board
+                    queue_to_printer_board(0x121);
+                    queue_to_printer_board(0x001);
+                }
+                idRequested = TRUE;
+                requestTime = milliseconds();
+            }
+            lastFunctionBoardCmd = function_board_cmd;
 
             wwKey = ww_decode_keys(function_board_cmd);         // convert the function board keystroke cmd into ASCII character
+            if (wwKey && !relaying) latency_decoded();          // start timing the key
             if (wwKey) {                                        // if it's a valid ASCII key...
                 if (wwKey == 0xF0) {                            // is it Code+Erase key combo?
                     if (column == 1) {                          // carrier must be at left margin to change modes
                         localMode = !localMode;                 // toggle the line/local flag
+                        relaying = FALSE;
+                        function_board_relay(FALSE);            // the visual indication goes through the queue
                         ww_spin();                              // spin the printwheel
                         ww_paper_up();                          // up 1/2 line, then
+                        ww_position_paper();
                         ww_paper_down();                        // down 1/2 line as a visual indication
+                        ww_position_paper();
+                        update_relay();                         // relay again if it's local mode now
                     }
                 }
                 else {
-                    if (localMode) 
+                    if (relaying)
+                       putchar(wwKey);                          // relayed, the Printer Board has printed it already
+                    else if (localMode) {
                        print_char_on_WW(wwKey);                 // if 'local' mode, print the ASCII character on the Wheelwriter
+                       ww_flush();                              // the typist expects the printer to follow every key
+                    }
                     else 
-                       putchar2(wwKey);                         // else print the ASCII character on the console
+                       host_key(wwKey);                         // else send it to the host, a line at a time if cooked
                 }
             }
         }
 
+        //////////// check for replies from the Printer Board (UART4) ////////////
+        if (printer_board_reply_avail()) {                      // if there's a reply from the Printer Board...
+            printer_board_status(get_printer_board_reply());    // keep the printer status up to date
+        }
+
         //////////// check for characters to print coming from the serial console (UART2)     ////////////
-        if (char_avail2()) {                                    // if there is a character in the serial receive buffer...
+        if (char_avail2() && !printer_board_offline() && !relaying) { // if there is a character in the serial receive buffer and somewhere to print it...
             ch = getchar2();                                    // retrieve the character from UART2
-            print_char_on_WW(ch);                               // send it to the Wheelwriter for printing
+            host_receive(ch);                                   // send it to the Wheelwriter for printing, unframing it if necessary
+            hostIdle = ONESEC;                                  // restart the host idle countdown
+        }
+        else if (!hostIdle && !hostPaced) {                     // if the host has been quiet for a second, and not because it's paused...
+            ww_flush();                                         // let the printer catch up with anything buffered or pending
         }
 
         //////////// check for characters to coming from the debug serial connection (UART1) ////////////
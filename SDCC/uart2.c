@@ -1,62 +1,142 @@
 //************************************************************************//
-// Interrupt driven UART2 functions with RTS/CTS handshaking.             //
+// Interrupt driven UART2 functions with RTS/CTS or XON/XOFF handshaking. //
 // for the Small Device C Compiler (SDCC)                                 //
 //
-// UART2 uses a receive buffer in internal MOVX SRAM.                     //
+// UART2 uses a 2K byte receive (spool) buffer and a transmit buffer in   //
+// internal MOVX SRAM. Transmission pauses while the host holds CTS high. //
 // UART2 uses the Timer 2 for baud rate generation. init_uart2 must be    //
 // called before using functions. No syntax error handling.               //
 // RxD2 on pin 9, TxD2 on pin 10, RTS on pin 11, CTS on pin 12            //
+// The baud rate can be measured from the host's first character using    //
+// the PCA counter.                                                       //
 //************************************************************************//
 
 #include "reg51.h"
 #include "stc51.h"
+#include "uart2.h"
 
 #define FALSE 0
 #define TRUE  1
 #define FOSC 12000000L                             // 12 MHz system clock frequency
-#define RBUFSIZE2 128                              // must be 256,128,64 or 32 bytes
+#define RBUFSIZE2 2048                             // must be a power of 2 from 256 to 2048 bytes
 
-#if RBUFSIZE2 < 32
-    #error RBUFSIZE2 may not be less than 32.
-#elif RBUFSIZE2 > 256
-    #error RBUFSIZE2 may not be greater than 256.
+#if RBUFSIZE2 < 256
+    #error RBUFSIZE2 may not be less than 256.
+#elif RBUFSIZE2 > 2048
+    #error RBUFSIZE2 may not be greater than 2048.
 #elif ((RBUFSIZE2 & (RBUFSIZE2-1)) != 0)
     #error RBUFSIZE2 must be a power of 2.
 #endif
 
-#define PAUSELEVEL RBUFSIZE2/4                     // pause communications to avoid overflow (RTS = 1) when buffer space < 64 bytes
-#define RESUMELEVEL RBUFSIZE2/2                    // resume communications (RTS = 0) when buffer space > 128 bytes
+#define PAUSELEVEL RBUFSIZE2/16                    // pause communications to avoid overflow (RTS = 1) when buffer space < 128 bytes
+#define RESUMELEVEL RBUFSIZE2/4                    // resume communications (RTS = 0) when buffer space > 512 bytes
+#define FIFOSIZE 16                                // characters the host's UART may still send after it has stopped
+#define XOFFMS 20                                  // milliseconds the host may take to act on XOFF
+#define IDLEUS 1100                                // microseconds without an edge that end a character being timed for its baud rate
+#define XON  0x11                                  // DC1 resumes communications
+#define XOFF 0x13                                  // DC3 pauses communications
+#define ENQ  0x05                                  // asks for the status report
+#define ETX  0x03                                  // ends a block the host wants acknowledged
+
+#define TBUFSIZE2 128                              // must be 128,64,32 or 16 bytes
+#if TBUFSIZE2 < 16
+    #error TBUFSIZE2 may not be less than 16.
+#elif TBUFSIZE2 > 128
+    #error TBUFSIZE2 may not be greater than 128.
+#elif ((TBUFSIZE2 & (TBUFSIZE2-1)) != 0)
+    #error TBUFSIZE2 must be a power of 2.
+#endif
 
 __sbit __at (0x92) RTS;                            // RTS output on pin 11
-__sbit __at (0x93) CTS;                            // CTS input on pin 12 (not used)
+__sbit __at (0x93) CTS;                            // CTS input on pin 12, high when the host isn't ready for characters
+__sbit __at (0x90) RXD2;                           // RxD2 input on pin 9, timed to measure the host's baud rate
 
-volatile unsigned char rx2_head;                   // index used to fill receive buffer
-volatile unsigned char rx2_tail;                   // index used to empty receive buffer
-volatile unsigned char rx2_remaining;              // receive buffer space remaining
+volatile unsigned int rx2_head;                    // index used to fill receive buffer
+volatile unsigned int rx2_tail;                    // index used to empty receive buffer
+volatile unsigned int rx2_remaining;               // receive buffer space remaining
 volatile unsigned char __xdata rx2_buf[RBUFSIZE2]; // receive buffer  in internal MOVX RAM
-volatile __bit tx2_ready;                          // set when ready to transmit
+volatile unsigned char tx2_head;                   // index used to fill transmit buffer
+volatile unsigned char tx2_tail;                   // index used to empty transmit buffer
+volatile unsigned char __xdata tx2_buf[TBUFSIZE2]; // transmit buffer in internal MOVX RAM
+volatile __bit tx2_busy;                           // set while the transmitter is sending a character
+unsigned int __xdata rx2_overflows = 0;            // characters lost because the receive buffer was full
+unsigned int __xdata tx2_overflows = 0;            // characters lost because the transmit buffer was full
+volatile unsigned char rx2_hold;                   // reasons to keep RTS high regardless of the receive buffer
+__bit autobaud = FALSE;                            // set while waiting to measure the host's baud rate
+__bit xonxoff = FALSE;                             // XON/XOFF handshaking instead of RTS/CTS
+__bit enquiry = TRUE;                              // ENQ from the host asks for a status report instead of being buffered
+volatile __bit enquired = FALSE;                   // set when the host has sent ENQ
+__bit etxCounting = FALSE;                         // ETX from the host is counted instead of being buffered
+volatile unsigned char etxReceived = 0;            // ETX characters received and not yet acknowledged
+volatile __bit tx2_stopped = FALSE;                // set when the host has sent XOFF, cleared by XON
+volatile unsigned char tx2_priority = 0;           // XON or XOFF to send ahead of the transmit buffer
+volatile __bit xoffResent = FALSE;                 // set once XOFF has been sent a second time, cleared when communications resume
+volatile unsigned int rx2_pause = PAUSELEVEL;      // pause communications when buffer space drops below this
+volatile unsigned int rx2_resume = RESUMELEVEL;    // resume communications when buffer space rises above this
+unsigned long lastBaudrate = AUTOBAUD;             // the rate given to uart2_baudrate(), for the pause and resume levels
+
+__code unsigned long baudRates[BAUDRATES] = {9600,19200,38400,57600,115200,230400};
 
 // ---------------------------------------------------------------------------
 // UART2 interrupt service routine
 // ---------------------------------------------------------------------------
 void uart2_isr(void) __interrupt(8) __using(3) {
+    unsigned char c;
 
     // UART2 transmit interrupt
     if (S2TI) {                                    // is this a transmit interrupt?
       CLR_S2TI;                                    // clear transmit interrupt flag
-      tx2_ready = TRUE;                            // transmit buffer is ready for a new character
+      if (tx2_priority) {                          // XON or XOFF goes ahead of everything, even when stopped
+         S2BUF = tx2_priority;
+         tx2_priority = 0;
+         tx2_busy = TRUE;
+      }
+      else if ((tx2_head != tx2_tail) && (xonxoff ? !tx2_stopped : !CTS)) {// if there's a character waiting and the host is ready for it...
+         S2BUF = tx2_buf[tx2_tail++ & (TBUFSIZE2-1)];
+         tx2_busy = TRUE;
+      }
+      else
+         tx2_busy = FALSE;                         // idle until putchar2() or uart2_check() starts it again
     }
 
     // UART2 receive interrupt
     if(S2RI) {                                     // is this a receive interrupt?
        CLR_S2RI;                                   // clear receive interrupt flag
-       rx2_buf[rx2_head++ & (RBUFSIZE2-1)] = S2BUF;// get character from serial port and put into serial fifo.
-      --rx2_remaining;                             // space remaining in UART2 buffer decreases
-        if (!RTS){                                 // if communications is not now paused...
-         if (rx2_remaining < PAUSELEVEL) {         // if the remaining buffer space is low...
-               RTS = 1;                            // pause communications when space in UART2 buffer decreases to less than 64 bytes
-            }
-      }
+       c = S2BUF;
+       if (xonxoff && ((c == XON) || (c == XOFF))) {// flow control from the host isn't put in the buffer
+          tx2_stopped = (c == XOFF);
+          if (!tx2_stopped && !tx2_busy)
+             SET_S2TI;                             // interrupt again to send what's waiting
+          return;
+       }
+       if (enquiry && (c == ENQ)) {                // a status request is answered ahead of the buffer
+          enquired = TRUE;
+          return;
+       }
+       if (etxCounting && (c == ETX)) {            // the end of a block is acknowledged once there's room for the next
+          ++etxReceived;
+          return;
+       }
+       if (!rx2_remaining) {                       // if the receive buffer is full...
+          ++rx2_overflows;                         // the character is lost
+          return;
+       }
+       rx2_buf[rx2_head++ & (RBUFSIZE2-1)] = c;    // put the character into the serial fifo.
+       --rx2_remaining;                            // space remaining in UART2 buffer decreases
+       if (!RTS) {                                 // if communications is not now paused...
+          if (rx2_remaining < rx2_pause) {         // if the remaining buffer space is low...
+             RTS = 1;                              // pause communications
+             if (xonxoff) {
+                tx2_priority = XOFF;
+                if (!tx2_busy) SET_S2TI;           // interrupt again to send XOFF
+             }
+          }
+       }
+       else if (xonxoff && !xoffResent && (rx2_remaining < rx2_pause/2) && !tx2_priority) {// still coming, the first XOFF may have been lost
+          xoffResent = TRUE;                       // only once, a host that ignores two won't heed more
+          tx2_priority = XOFF;
+          if (!tx2_busy) SET_S2TI;
+       }
     }
 }
 
@@ -67,12 +147,13 @@ void uart2_init(unsigned long baudrate) {
     rx2_head = 0;                                  // initialize UART3 buffer head/tail pointers.
     rx2_tail = 0;
     rx2_remaining = RBUFSIZE2;
+    rx2_hold = FALSE;
+    tx2_head = 0;
+    tx2_tail = 0;
+    tx2_busy = FALSE;
 
     CLR_T2_CT;                                     // clear T2_C/T to make Timer 2 operate as timer instead of counter
     SET_T2x12;                                     // set T2x12=1 to make Timer 2 operate in 1T mode.
-    T2L = (65536-(FOSC/4/baudrate));               // low byte of preload
-    T2H = (65536-(FOSC/4/baudrate))>>8;            // high byte of preload
-    SET_T2R;                                       // set T2R to enable Timer 2 to run
     S2CON = 0x50;                                  // UART2 for mode 1
 
     SET_S2REN;                                     // set S2REN to enable reception
@@ -81,13 +162,140 @@ void uart2_init(unsigned long baudrate) {
     RTS = 0;                                       // clear RTS to allow transmissions from remote console
     SET_ES2;                                       // set ES2 to enable UART2 serial interrupt
     EA = TRUE;                                     // enable global interrupt
+    uart2_baudrate(baudrate);                      // load the Timer 2 preload and run Timer 2
+}
+
+// ---------------------------------------------------------------------------
+// sets the buffer levels where communications pause and resume. with
+// XON/XOFF the host takes longer to stop, so the pause level also leaves
+// room for the characters it sends in XOFFMS milliseconds at the current
+// baud rate (10 bits per character) plus its UART's FIFO.
+// ---------------------------------------------------------------------------
+static void set_levels(void) {
+   unsigned int headroom = 0;
+
+   if (xonxoff && (lastBaudrate != AUTOBAUD))
+      headroom = (lastBaudrate/10)*XOFFMS/1000+FIFOSIZE;
+   CLR_ES2;                                        // the ISR reads the 16 bit levels
+   rx2_pause = PAUSELEVEL+headroom;
+   rx2_resume = RESUMELEVEL+headroom;
+   SET_ES2;
+}
+
+// ---------------------------------------------------------------------------
+// changes the baud rate of UART2 without disturbing the receive buffer.
+// AUTOBAUD turns the receiver off until uart2_autobaud() has measured the
+// host's baud rate.
+// ---------------------------------------------------------------------------
+void uart2_baudrate(unsigned long baudrate) {
+   while (tx2_busy);                               // let the character being sent finish at the old rate
+   if (baudrate == AUTOBAUD) {
+      autobaud = TRUE;
+      CLR_S2REN;                                   // ignore the host until its baud rate is known
+      return;
+   }
+   autobaud = FALSE;
+   lastBaudrate = baudrate;
+   set_levels();                                   // headroom for XON/XOFF depends on the baud rate
+   CLR_T2R;                                        // stop Timer 2 while the preload changes
+   T2L = (65536-(FOSC/4/baudrate));                // low byte of preload
+   T2H = (65536-(FOSC/4/baudrate))>>8;             // high byte of preload
+   SET_T2R;                                        // run Timer 2
+   SET_S2REN;                                      // enable reception
+}
+
+// ---------------------------------------------------------------------------
+// called from the main loop while UART2 waits for its baud rate. once the
+// host starts sending (RxD2 low), the pulses on RxD2 are timed with the 16
+// bit PCA counter at 1 microsecond per count until the line has been quiet
+// for IDLEUS microseconds, longer than the 9 bits of one level a character
+// can hold at 9600 baud. the shortest complete pulse is one bit time as long
+// as the character has a single 0 or 1 bit, such as the start bit of a
+// carriage return or any bit of 'U'. UART2 is switched to the standard rate
+// nearest to 1/(bit time). characters sent while the rate is measured are
+// lost. returns the baud rate, or AUTOBAUD if it isn't known yet.
+// ---------------------------------------------------------------------------
+unsigned long uart2_autobaud(void) {
+   unsigned char edges,i,best,hi,lo;
+   unsigned int start,width,shortest;
+   unsigned long error,bestError;
+   __bit level;
+
+   if (!autobaud || RXD2) return AUTOBAUD;         // not waiting, or the line is idle
+
+   CMOD = 0x00;                                    // the PCA counts SYSclk/12, 1 microsecond per count
+   CL = 0;
+   CH_PCA = 0;
+   CCON = 0x40;                                    // run the PCA counter
+   level = RXD2;
+   start = 0;
+   shortest = 0xFFFF;
+   edges = 0;
+   while (edges < 100) {
+      do {                                         // CL may carry into CH between the two reads
+         hi = CH_PCA;
+         lo = CL;
+      } while (hi != CH_PCA);
+      width = (((unsigned int)hi<<8)|lo)-start;
+      if (RXD2 != level) {                         // the end of a pulse...
+         start += width;
+         level = !level;
+         if (edges++ && (width < shortest))        // the first pulse started before it was being timed
+            shortest = width;
+      }
+      else if (width > IDLEUS)                     // no edges for IDLEUS microseconds, the character is finished
+         break;
+   }
+   CCON = 0;                                       // stop the PCA counter
+   if ((shortest == 0xFFFF) || (shortest < 3) || !RXD2)
+      return AUTOBAUD;                             // no complete pulse, a glitch or a break, wait for the next character
+
+   best = 0;
+   bestError = 0xFFFFFFFF;
+   for (i = 0; i < BAUDRATES; i++) {               // find the rate whose bit time is nearest the shortest pulse
+      error = (unsigned long)shortest*baudRates[i];
+      error = (error > 1000000L) ? error-1000000L : 1000000L-error;
+      if (error < bestError) {
+         bestError = error;
+         best = i;
+      }
+   }
+   uart2_baudrate(baudRates[best]);
+   return baudRates[best];
+}
+
+// ---------------------------------------------------------------------------
+// pause and resume communications from the host: RTS, and with XON/XOFF
+// handshaking the XOFF or XON character ahead of anything else being sent.
+// called with the UART2 interrupt disabled.
+// ---------------------------------------------------------------------------
+static void pause_host(void) {
+   if (!RTS && xonxoff) {
+      tx2_priority = XOFF;
+      if (!tx2_busy) SET_S2TI;                     // interrupt to send XOFF
+   }
+   RTS = 1;
+}
+
+static void resume_host(void) {
+   xoffResent = FALSE;                             // the next pause may send XOFF again
+   if (RTS && xonxoff) {
+      tx2_priority = XON;
+      if (!tx2_busy) SET_S2TI;                     // interrupt to send XON
+   }
+   RTS = 0;
 }
 
 // ---------------------------------------------------------------------------
 // returns 1 if there is a character waiting in the UART2 receive buffer
 // ---------------------------------------------------------------------------
 char char_avail2(void) {
-   return (rx2_head != rx2_tail);
+   char avail;
+
+   CLR_ES2;                                        // the 16 bit head index is read one byte at a time
+   avail = (rx2_head != rx2_tail);
+   SET_ES2;
+   return (avail);
 }
 
 //-----------------------------------------------------------
@@ -95,27 +303,149 @@ char char_avail2(void) {
 // buffer. returns the character. does not echo the character.
 //-----------------------------------------------------------
 char getchar2(void) {
-    unsigned char buf;
+   unsigned char buf;
 
-    while (rx2_head == rx2_tail);                  // wait until a character is available
-    buf = rx2_buf[rx2_tail++ &(RBUFSIZE2-1)];
+   while (!char_avail2());                         // wait until a character is available
+   buf = rx2_buf[rx2_tail++ &(RBUFSIZE2-1)];
+   CLR_ES2;                                        // the ISR also updates rx2_remaining
    ++rx2_remaining;                                // space remaining in buffer increases
-   if (RTS) {                                      // if communications is now paused...
-         if (rx2_remaining > RESUMELEVEL) {
-            RTS = 0;                               // clear RTS to resume communications when space remaining in buffer increases above 128 bytes
-         }
+   if (RTS && !rx2_hold) {                         // if communications is now paused...
+      if (rx2_remaining > rx2_resume)
+         resume_host();                            // resume communications when space remaining in buffer increases above the resume level
    }
-    return(buf);
+   SET_ES2;
+   return(buf);
+}
+
+// ---------------------------------------------------------------------------
+// when hold is 1, RTS is kept high for "reason" (HOLD_OFFLINE, HOLD_PACING, HOLD_FLASH)
+// to pause communications from the host regardless of the space in the
+// receive buffer. when hold is 0 for every reason, RTS goes back to
+// following the receive buffer.
+// ---------------------------------------------------------------------------
+void uart2_hold(unsigned char reason,char hold) {
+   if (hold)
+      rx2_hold |= reason;
+   else
+      rx2_hold &= ~reason;
+   CLR_ES2;
+   if (rx2_hold)
+      pause_host();                                // pause communications
+   else if (rx2_remaining > rx2_resume)
+      resume_host();                               // resume communications if there's room in the buffer
+   SET_ES2;
 }
 
 // ---------------------------------------------------------------------------
-// sends one character out UART2. waits until ready to transmit.
+// puts one character in the UART2 transmit buffer and starts the transmitter
+// if it's idle. doesn't wait. when the buffer is full, or while waiting to
+// measure the host's baud rate, the character is dropped.
 // ---------------------------------------------------------------------------
 char putchar2(char c)  {
-   while (!tx2_ready);                             // wait here for transmit ready
-   S2BUF = c;
-   tx2_ready = 0;
+   if (autobaud) return (c);                       // the host's baud rate isn't known yet
+   if ((unsigned char)(tx2_head-tx2_tail) == TBUFSIZE2) {
+      ++tx2_overflows;                             // the transmit buffer is full, the character is lost
+      return (c);
+   }
+   tx2_buf[tx2_head & (TBUFSIZE2-1)] = c;
+   ++tx2_head;                                     // the ISR may take the character from here on
+   CLR_ES2;                                        // the ISR may start the transmitter between the test and S2TI
+   if (!tx2_busy)
+      SET_S2TI;                                    // interrupt to start the transmitter
+   SET_ES2;
    return (c);
 }
 
+// ---------------------------------------------------------------------------
+// called from the main loop. the transmitter goes idle when the host holds
+// CTS high. this starts it again once the host sets CTS low. (with XON/XOFF
+// the ISR starts it again when XON is received.)
+// ---------------------------------------------------------------------------
+void uart2_check(void) {
+   CLR_ES2;
+   if (!tx2_busy && !xonxoff && !CTS && (tx2_head != tx2_tail))
+      SET_S2TI;                                    // interrupt to send the next character
+   SET_ES2;
+}
+
+// ---------------------------------------------------------------------------
+// selects XON/XOFF (xon is 1) or RTS/CTS (xon is 0) handshaking. RTS still
+// follows the receive buffer with XON/XOFF. with XON/XOFF on, the host
+// can't send 0x11 or 0x13 as data.
+// ---------------------------------------------------------------------------
+void uart2_handshake(char xon) {
+   CLR_ES2;
+   xonxoff = xon;
+   tx2_stopped = FALSE;
+   SET_ES2;
+   set_levels();
+   CLR_ES2;
+   if (!tx2_busy)
+      SET_S2TI;                                    // interrupt to send anything that was waiting
+   SET_ES2;
+}
+
+// ---------------------------------------------------------------------------
+// returns 1 once each time the host has sent ENQ to ask for a status report
+// ---------------------------------------------------------------------------
+char uart2_enquired(void) {
+   if (!enquired) return FALSE;
+   enquired = FALSE;
+   return TRUE;
+}
+
+// ---------------------------------------------------------------------------
+// when on is 1, ENQ from the host asks for a status report. when on is 0
+// (framed mode) ENQ is buffered like any other character.
+// ---------------------------------------------------------------------------
+void uart2_enquiry(char on) {
+   enquiry = on;
+}
+
+// ---------------------------------------------------------------------------
+// returns the number of characters putchar2() can take without losing any
+// ---------------------------------------------------------------------------
+unsigned char uart2_tx_free(void) {
+   return TBUFSIZE2-(unsigned char)(tx2_head-tx2_tail);
+}
+
+// ---------------------------------------------------------------------------
+// returns the number of characters waiting in the receive buffer
+// ---------------------------------------------------------------------------
+unsigned int uart2_waiting(void) {
+   unsigned int waiting;
+
+   CLR_ES2;                                        // the ISR also updates rx2_remaining
+   waiting = RBUFSIZE2-rx2_remaining;
+   SET_ES2;
+   return waiting;
+}
+
+// ---------------------------------------------------------------------------
+// when on is 1, ETX from the host is counted as it arrives instead of being
+// buffered, for acknowledging blocks as soon as they are in the buffer.
+// ---------------------------------------------------------------------------
+void uart2_etx(char on) {
+   CLR_ES2;
+   etxCounting = on;
+   etxReceived = 0;
+   SET_ES2;
+}
+
+// ---------------------------------------------------------------------------
+// returns 1, and counts the ETX as acknowledged, if an ETX has arrived and
+// there's room in the receive buffer for another block of "block" characters
+// ---------------------------------------------------------------------------
+char uart2_etx_ack(unsigned int block) {
+   char ack = FALSE;
+
+   CLR_ES2;                                        // the ISR also updates etxReceived and rx2_remaining
+   if (etxReceived && (rx2_remaining >= block)) {
+      --etxReceived;
+      ack = TRUE;
+   }
+   SET_ES2;
+   return ack;
+}
+
 
@@ -6,15 +6,35 @@
 // internal MOVX SRAM. UART3 uses the Timer 3 for baud rate generation.   //
 // init_uart3 must be called before using functions. No syntax error      //
 // handling. No handshaking. RxD3 on pin 1, TxD3 on pin 2                 //
+//                                                                        //
+// Once function_board_acks(1) has been called the ISR acknowledges       //
+// each word from the Function Board as soon as it arrives, the way       //
+// the Printer Board would, so the keyboard doesn't wait for the main     //
+// loop. function_board_hold() withholds the acknowledge, which stops     //
+// the Function Board sending, until every reason for holding is gone.    //
+// The ISR itself holds it while fewer than FREELEVEL words are free in   //
+// the receive buffer. A word that arrives when the buffer is full is     //
+// counted in rx3_overflows and dropped rather than written over one      //
+// that hasn't been read.                                                 //
+//                                                                        //
+// In relay mode (function_board_relay(1)) the ISR passes each word       //
+// straight on to the Printer Board through UART4 and the Printer         //
+// Board's reply is sent back in place of the acknowledge, so the         //
+// Function Board is answered by the Printer Board itself. The reply is   //
+// withheld like an acknowledge while the receive buffer is nearly full.  //
+// A reply that doesn't come by RELAYTIMEOUT is replaced by a plain       //
+// acknowledge. The words are still buffered for ww_decode_keys().        //
 //************************************************************************//
 
 #include "reg51.h"
 #include "stc51.h"
+#include "ww-uart3.h"
+#include "latency.h"
 
 #define FALSE 0
 #define TRUE  1
 
-#define RBUFSIZE3 16                             // must be 128, 64, 32, 16 or 4 bytes
+#define RBUFSIZE3 32                             // must be 128, 64, 32, 16 or 4 words
 #if RBUFSIZE3 < 4
     #error RBUFSIZE3 may not be less than 4.
 #elif RBUFSIZE3 > 128
@@ -22,12 +42,29 @@
 #elif ((RBUFSIZE3 & (RBUFSIZE3-1)) != 0)
     #error RBUFSIZE3 must be a power of 2.
 #endif
+#define RELAYTIMEOUT 40                         // 50 millisecond ticks to wait for the Printer Board's reply to a relayed word (2 seconds)
+#define FREELEVEL 4                             // withhold the acknowledge while fewer words than this are free
 
 volatile unsigned char rx3_head;                  // receive interrupt index for UART3
 volatile unsigned char rx3_tail;                  // receive read index for UART3
 volatile unsigned int __xdata rx3_buf[RBUFSIZE3]; // receive buffer for UART3 1 in internal MOVX RAM
 volatile __bit tx3_ready;                         // set when ready to transmit
+__bit acks = FALSE;                               // set when the ISR acknowledges words from the Function Board
+volatile __bit ackOwed = FALSE;                   // a word has arrived and hasn't been acknowledged yet
+volatile __bit acking = FALSE;                    // set while an acknowledge or a relayed reply is sent
+volatile __bit relay = FALSE;                     // set while words are relayed to the Printer Board
+volatile __bit relayPending = FALSE;              // a relayed word is waiting for the Printer Board's reply
+volatile unsigned char relayTimer;                // decremented every 50 milliseconds by timer 0, deadline for the reply
+volatile unsigned int ackWord = 0;                // sent as the acknowledge: 0, or the Printer Board's reply when relaying
+volatile unsigned char ackHold = 0;               // reasons for withholding the acknowledge, see ww-uart3.h
+unsigned int __xdata rx3_overflows = 0;           // words lost because the receive buffer was full
+unsigned int __xdata rx3_holds = 0;               // times the acknowledge was withheld because the receive buffer was nearly full
 __sbit __at (0x80) WWbus3;                        // P0.0, (RXD3, pin 1) used to monitor the Wheelwriter BUS
+extern volatile __bit tx4_ready;                  // defined in ww-uart4.c
+extern volatile unsigned int tickCount;           // defined in main.c
+extern volatile unsigned int __xdata keyStamps[]; // defined in latency.c
+extern volatile unsigned char keyStampHead;       // defined in latency.c
+extern unsigned int __xdata ackTimeouts;          // defined in ww-uart4.c
 
 // ---------------------------------------------------------------------------
 // UART3 interrupt service routine
@@ -39,6 +76,10 @@ void uart3_isr(void) __interrupt(17) __using(3) {
     // UART3 transmit interrupt
     if (S3TI) {                                 // transmit interrupt?
       CLR_S3TI;                                 // clear transmit interrupt flag
+      if (acking) {                             // the acknowledge has gone...
+         acking = FALSE;
+         SET_S3REN;                             // ...listen to the bus again
+      }
       tx3_ready = TRUE;                         // transmit buffer is ready for a new character
     }
 
@@ -46,7 +87,40 @@ void uart3_isr(void) __interrupt(17) __using(3) {
        CLR_S3RI;                                // clear receive interrupt flag
        wwBusData = S3BUF;                       // retrieve the lower 8 bits
        if (S3RB8) wwBusData |= 0x0100;          // ninth bit is in S3RB8
-       rx3_buf[rx3_head++ & (RBUFSIZE3-1)] = wwBusData;  // save it in the buffer
+       if ((unsigned char)(rx3_head-rx3_tail) == RBUFSIZE3)
+          ++rx3_overflows;                      // the buffer is full, the word is lost
+       else {
+          rx3_buf[rx3_head++ & (RBUFSIZE3-1)] = wwBusData;  // save it in the buffer
+          if (wwBusData == 0x121) {             // the start of a key, stamp it for latency.c
+             LATENCY_STAMP(keyStamps[keyStampHead & (KEYSTAMPS-1)]);
+             ++keyStampHead;
+          }
+       }
+       if (relay) {                             // relay mode, straight on to the Printer Board
+          relayPending = TRUE;
+          relayTimer = RELAYTIMEOUT;            // start the deadline for the reply
+          tx4_ready = FALSE;
+          CLR_S4REN;                            // the UART4 ISR listens for the reply once the word is out
+          if (wwBusData & 0x100) SET_S4TB8; else CLR_S4TB8; // 9th bit
+          S4BUF = wwBusData & 0xFF;             // lower 8 bits
+       }
+       if (acks) ackOwed = TRUE;
+       if (((unsigned char)(rx3_head-rx3_tail) > RBUFSIZE3-FREELEVEL) && !(ackHold & ACKHOLD_FULL)) {
+          ackHold |= ACKHOLD_FULL;              // the Function Board waits until words have been read
+          ++rx3_holds;
+       }
+    }
+
+    // the bus is only low while the Function Board is sending the next word;
+    // the receive interrupt at the end of that word gets here again
+    if (ackOwed && tx3_ready && !ackHold && WWbus3) { // acknowledge as soon as the transmitter and the bus are free
+       ackOwed = FALSE;
+       tx3_ready = FALSE;
+       acking = TRUE;
+       CLR_S3REN;                               // don't receive the acknowledge
+       if (ackWord & 0x100) SET_S3TB8; else CLR_S3TB8; // 9th bit
+       S3BUF = ackWord & 0xFF;                  // lower 8 bits
+       ackWord = 0;                             // a plain acknowledge next time unless the Printer Board replies
     }
 }
 
@@ -80,18 +154,98 @@ void uart3_init(void) {
 }
 
 // ---------------------------------------------------------------------------
-// sends Acknowledge (all zeros) to the Function Board
+// waits for the transmitter and keeps the ISR from starting an acknowledge
+// with it
 // ---------------------------------------------------------------------------
-void send_ACK_to_function_board(void) {
-   while (!tx3_ready);                          // wait until transmit buffer is empty
+static void claim_transmitter(void) {
+   for (;;) {
+      while (!tx3_ready);                       // wait until transmit buffer is empty
+      CLR_ES3;
+      if (tx3_ready) break;                     // the ISR didn't take it first
+      SET_ES3;
+   }
    tx3_ready = 0;                               // clear flag
-   while(!WWbus3);                              // wait until the Wheelwriter bus goes high
-   CLR_S3REN;                                   // clear S3REN to disable reception
-   CLR_S3TB8;                                   // clear 9th bit
-   S3BUF = 0x00;                                // clear lower 8 bits
-   while(!tx3_ready);                           // wait until finished transmitting
-   while(!WWbus3);                              // wait until the Wheelwriter bus goes high
-   SET_S3REN;                                   // set S3REN to re-enable reception
+   SET_ES3;
+}
+
+// ---------------------------------------------------------------------------
+// gets the ISR to send an owed acknowledge if nothing holds it and the
+// transmitter is free. UART3 interrupt must be disabled.
+// ---------------------------------------------------------------------------
+static void send_owed(void) {
+   if (!ackHold && ackOwed && tx3_ready) {
+      tx3_ready = FALSE;
+      SET_S3TI;                                 // interrupt to send the acknowledge
+   }
+}
+
+// ---------------------------------------------------------------------------
+// when on is 1, the ISR acknowledges each word from the Function Board.
+// off while the Printer Board's own replies are relayed to the Function Board.
+// ---------------------------------------------------------------------------
+void function_board_acks(char on) {
+   CLR_ES3;
+   acks = on;
+   ackOwed = FALSE;
+   SET_ES3;
+}
+
+// ---------------------------------------------------------------------------
+// when on is 1, words from the Function Board are relayed to the Printer Board
+// by the ISRs and answered by the Printer Board; when on is 0 the ISR
+// acknowledges them itself. the Printer Board command queue must be idle
+// while relaying. a relayed word still waiting for its reply gets a plain
+// acknowledge.
+// ---------------------------------------------------------------------------
+void function_board_relay(char on) {
+   while (!tx4_ready);                          // let a relayed word finish going out
+   CLR_ES3;
+   CLR_ES4;
+   relay = on;
+   acks = !on;
+   if (relayPending) {
+      relayPending = FALSE;
+      ackOwed = TRUE;
+   }
+   send_owed();
+   SET_ES4;
+   SET_ES3;
+}
+
+// ---------------------------------------------------------------------------
+// call regularly from the main loop. if the Printer Board hasn't replied to a
+// relayed word by the deadline, the Function Board gets a plain acknowledge
+// instead of waiting for it forever.
+// ---------------------------------------------------------------------------
+void function_board_check(void) {
+   if (relayPending && !relayTimer) {
+      CLR_ES3;
+      CLR_ES4;                                  // keep both ISRs out while we look
+      if (relayPending && !relayTimer) {        // still no reply
+         relayPending = FALSE;
+         ++ackTimeouts;
+         ackOwed = TRUE;
+         send_owed();
+      }
+      SET_ES4;
+      SET_ES3;
+   }
+}
+
+// ---------------------------------------------------------------------------
+// withholds (hold is 1) or releases (hold is 0) the acknowledge for one of
+// the reasons in ww-uart3.h. a word that arrives while held is acknowledged
+// once nothing holds it any longer.
+// ---------------------------------------------------------------------------
+void function_board_hold(unsigned char reason,char hold) {
+   CLR_ES3;
+   if (hold)
+      ackHold |= reason;
+   else {
+      ackHold &= ~reason;
+      send_owed();
+   }
+   SET_ES3;
 }
 
 // ---------------------------------------------------------------------------
@@ -99,8 +253,7 @@ void send_ACK_to_function_board(void) {
 // to the Function Board. does not wait for acknowledge
 // ---------------------------------------------------------------------------
 void send_to_function_board(unsigned int wwCommand) {
-   while (!tx3_ready);                          // wait until transmit buffer is empty
-   tx3_ready = 0;                               // clear flag
+   claim_transmitter();                         // wait until transmit buffer is empty
    while(!WWbus3);                              // wait until the Wheelwriter bus goes high
    CLR_S3REN;                                   // clear S3REN to disable reception
    if (wwCommand & 0x100) SET_S3TB8; else CLR_S3TB8; // 9th bit
@@ -126,6 +279,8 @@ unsigned int get_function_board_cmd(void) {
 
     while (rx3_head == rx3_tail);               // wait until a word is available
     buf = rx3_buf[rx3_tail++ & (RBUFSIZE3-1)];  // retrieve the word from the buffer
+    if ((ackHold & ACKHOLD_FULL) && ((unsigned char)(rx3_head-rx3_tail) <= RBUFSIZE3-FREELEVEL))
+        function_board_hold(ACKHOLD_FULL,FALSE); // room again, acknowledge the word that's waiting
     return(buf);
 }
 
@@ -0,0 +1,108 @@
+//************************************************************************//
+// Runs the host link code from host.c on a PC so that compressed input   //
+// can be checked against tools/wwcompress.py. Characters read from stdin //
+// go to host_receive() and the characters it would print are written to  //
+// stdout. <ESC><z><n> turns compressed input on and off as it does in    //
+// print_char_on_WW() and isn't written.                                  //
+//                                                                        //
+//   cc -DHOST_C='"../SDCC/host.c"' -o expand_test expand_test.c          //
+//                                                                        //
+// HOST_C may be either tree's host.c. test_wwcompress.py builds and runs //
+// this for both.                                                         //
+//************************************************************************//
+
+#include <stdio.h>
+
+// the compiler keywords used by the two trees
+#define __xdata
+#define __code
+#define __bit unsigned char
+#define xdata
+#define code
+#define bit unsigned char
+
+// host.c's own headers declare the interrupt service routines, which a PC
+// compiler can't take, so they're skipped and what host.c uses is declared
+// here instead
+#define __UART2_H__
+#define __UART3_H__
+#define __UART4_H__
+
+char putchar2(char c);
+void uart2_etx(char on);
+void uart2_enquiry(char on);
+unsigned int uart2_waiting(void);
+unsigned char uart2_tx_free(void);
+char uart2_etx_ack(unsigned int block);
+void uart2_hold(unsigned char reason,char hold);
+void function_board_hold(unsigned char reason,char hold);
+char printer_board_idle(void);
+char printer_board_offline(void);
+
+#define HOLD_OFFLINE 0x01
+#define HOLD_PACING  0x02
+#define ACKHOLD_LINE 0x01
+#define ACKHOLD_FULL 0x02
+
+#include HOST_C
+
+// ---------------------------------------------------------------------------
+// what host.c expects from the rest of the firmware
+// ---------------------------------------------------------------------------
+unsigned char column = 1;
+unsigned char printWheel = 0;
+unsigned char localMode = 0;
+unsigned char autoLineFeed = 0;
+unsigned char errorLED = 0;
+unsigned char printwheelPresent = 1;
+unsigned char uSpacesPerChar = 10;
+unsigned int uSpaceCount = 0;
+unsigned int rx2_overflows = 0;
+unsigned int tx2_overflows = 0;
+unsigned int ackTimeouts = 0;
+unsigned int offlineEvents = 0;
+
+void print_char_on_WW(unsigned char charToPrint) {
+    static unsigned char escape = 0;            // 1 after ESC, 2 after <ESC><z>
+
+    if (escape == 2) {
+        escape = 0;
+        host_compression(charToPrint & 0x01);
+    }
+    else if (escape == 1) {
+        escape = 0;
+        if (charToPrint == 'z')
+            escape = 2;
+        else {
+            putchar(ESC);                       // some other escape sequence, written as it is
+            putchar(charToPrint);
+        }
+    }
+    else if (charToPrint == ESC)
+        escape = 1;
+    else
+        putchar(charToPrint);
+}
+unsigned int ww_drain_time(void) { return 0; }
+void ww_flush(void) {}
+void ww_linefeed(void) {}
+char ww_raw(unsigned char c) { (void)c; return 1; }
+void ww_erase_letter(unsigned char letter) { (void)letter; }
+char putchar2(char c) { return c; }
+void uart2_etx(char on) { (void)on; }
+void uart2_enquiry(char on) { (void)on; }
+unsigned int uart2_waiting(void) { return 0; }
+unsigned char uart2_tx_free(void) { return 128; }
+char uart2_etx_ack(unsigned int block) { (void)block; return 0; }
+void uart2_hold(unsigned char reason,char hold) { (void)reason; (void)hold; }
+void function_board_hold(unsigned char reason,char hold) { (void)reason; (void)hold; }
+char printer_board_idle(void) { return 1; }
+char printer_board_offline(void) { return 0; }
+
+int main(void) {
+    int c;
+
+    while ((c = getchar()) != EOF)
+        host_receive((unsigned char)c);
+    return 0;
+}
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""Round trip test for compressed host input.
+
+Builds expand_test.c around each tree's host.c with the PC's C compiler
+(cc, or $CC), compresses a set of texts with wwcompress.py, expands them
+with the firmware's own expand() and checks that the texts come back
+unchanged.
+
+    python3 test_wwcompress.py
+"""
+
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+import wwcompress
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TREES = ('SDCC', 'C51')
+NOTESC = bytes(c for c in range(256) if c != 0x1B)  # ESC would be taken for an escape sequence
+
+
+def samples():
+    rng = random.Random(630)
+    yield b''
+    yield b'a'
+    yield b'The quick brown fox jumps over the lazy dog.\r\n' * 20
+    yield b' ' * 300                                    # runs from the spaces the window starts with
+    yield b'-' * 200 + b'\r\n'                          # runs longer than 63
+    yield b'abcabcabcabcabcabcabcabcabcabcabcabcabcabc'  # copies that overlap what they make
+    yield bytes(range(0x20, 0x7F)) * 4                  # copies from as far back as they go
+    yield bytes(range(0x80, 0x100)) + b'\xe9' * 70      # characters that need LITERAL, runs of them
+    yield b'\x05\x03\x11\x13' + b'\x01' * 5             # control characters are sent as themselves
+    for n in (50, 500, 5000):
+        yield bytes(rng.choice(b'aab \r\n\xe9') for _ in range(n))
+        yield bytes(rng.choice(NOTESC) for _ in range(n))
+    words = [b'ledger', b'total', b'  ', b'0.00', b'\r\n', b'-----', b'account']
+    yield b''.join(rng.choice(words) for _ in range(2000))
+
+
+def build(tree, tmp):
+    exe = os.path.join(tmp, 'expand_' + tree)
+    cc = os.environ.get('CC', 'cc')
+    subprocess.check_call([cc, '-DHOST_C="../%s/host.c"' % tree, '-o', exe, 'expand_test.c'], cwd=HERE)
+    return exe
+
+
+def main():
+    failures = 0
+    with tempfile.TemporaryDirectory() as tmp:
+        for tree in TREES:
+            exe = build(tree, tmp)
+            for i, text in enumerate(samples()):
+                stream = b'\x1bz1' + wwcompress.compress(text + b'\x1bz0')
+                result = subprocess.run([exe], input=stream, stdout=subprocess.PIPE, check=True).stdout
+                if result != text:
+                    failures += 1
+                    print('%s sample %d: %d characters came back as %d' % (tree, i, len(text), len(result)))
+                else:
+                    print('%s sample %d: %d characters in %d' % (tree, i, len(text), len(stream)))
+    print('FAILED' if failures else 'passed')
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""Compresses text for the Wheelwriter Teletype's compressed host input.
+
+The encoding is the one expand() in host.c undoes (see the host.c header):
+  0x00-0x7F      that character
+  0x80 <c>       the character c, for c of 0x80-0xFF
+  0x81-0xBF      the last character again, 1 to 63 times
+  0xC0-0xFF <d>  3 to 66 characters (the low 6 bits plus 3) copied
+                 from d-31 characters back, d is 0x20-0xFF
+Copies come from a window of the last 256 characters, which starts out
+as spaces, and may overlap the characters they make.
+
+    wwcompress.py [infile [outfile]]
+
+reads infile (or stdin) and writes <ESC><z><1>, the compressed text and a
+compressed <ESC><z><0> to outfile (or stdout), ready to send to the
+Teletype.
+"""
+
+import sys
+
+WINDOW = 256
+MAXRUN = 63
+MINCOPY = 3
+MAXCOPY = 66
+MAXBACK = 224                   # offsets 0x20-0xFF are 1-224 characters back
+OFFSETBASE = 0x1F
+LITERAL = 0x80
+COPY = 0xC0
+
+
+def compress(data):
+    """Returns the compressed form of data (bytes) for a window that starts
+    out as spaces, as it does after <ESC><z><1>."""
+    data = bytes(data)
+    history = b' ' * WINDOW     # what the window holds before the data
+    text = history + data
+    out = bytearray()
+    p = WINDOW
+    while p < len(text):
+        # a run of the last character
+        last = text[p-1]
+        run = 0
+        while run < MAXRUN and p+run < len(text) and text[p+run] == last:
+            run += 1
+        # the longest copy, which may overlap the characters it makes
+        copy, back = 0, 0
+        for b in range(1, min(MAXBACK, p)+1):
+            n = 0
+            while n < MAXCOPY and p+n < len(text) and text[p-b+n] == text[p+n]:
+                n += 1
+            if n > copy:
+                copy, back = n, b
+                if n == MAXCOPY:
+                    break
+        # characters saved by each choice
+        literalCost = 2 if text[p] >= 0x80 else 1
+        runGain = run-1 if run else -1
+        copyGain = copy-2 if copy >= MINCOPY else -1
+        literalGain = 1-literalCost
+        if copyGain > max(runGain, literalGain) and copyGain > 0:
+            out += bytes([COPY | (copy-MINCOPY), back+OFFSETBASE])
+            p += copy
+        elif runGain > literalGain and runGain >= 0 and run:
+            out.append(LITERAL | run)
+            p += run
+        else:
+            if text[p] >= 0x80:
+                out.append(LITERAL)
+            out.append(text[p])
+            p += 1
+    return bytes(out)
+
+
+def main(argv):
+    src = open(argv[1], 'rb') if len(argv) > 1 else sys.stdin.buffer
+    dst = open(argv[2], 'wb') if len(argv) > 2 else sys.stdout.buffer
+    data = src.read()
+    dst.write(b'\x1bz1' + compress(data + b'\x1bz0'))
+    dst.flush()
+
+
+if __name__ == '__main__':
+    main(sys.argv)
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""Generates the built-in key decoding table in wheelwriter.c.
+
+ww_decode_keys() turns the printwheel code of a key (1-96) into an ASCII
+character with one lookup in printwheel2ASCII[]. That table is the reverse
+of ASCII2printwheel[], which stays the one description of the printwheel,
+with the keys whose keycaps don't match the printwheel (KEYCAPS below) as
+exceptions. Run this after changing either, from anywhere:
+
+    wwkeymap.py           rewrites printwheel2ASCII[] in both trees
+    wwkeymap.py --check   only reports whether it's up to date (exit 1 if not)
+"""
+
+import os
+import re
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TREES = ('SDCC', 'C51')
+
+# printwheel code: the character its key produces (0 for nothing), where
+# that isn't the character ASCII2printwheel[] strikes with it
+KEYCAPS = {
+    0x25: '>',
+    0x27: '<',
+    0x41: '}',
+    0x45: 0,                    # the '<' and '>' printwheel positions produce nothing
+    0x46: 0,
+    0x47: '[',
+}
+
+FORWARD = re.compile(r'char (?:__)?code ASCII2printwheel\[96\] =\s*\{(.*?)\};', re.S)
+REVERSE = re.compile(r'char ((?:__)?code) printwheel2ASCII\[97\] = \{.*?\};[^\r\n]*', re.S)
+
+
+def forward(text, path):
+    """the 96 printwheel codes of ASCII2printwheel[] in text"""
+    m = FORWARD.search(text)
+    if not m:
+        raise SystemExit('%s: no ASCII2printwheel[]' % path)
+    body = '\n'.join(line.split('//')[0] for line in m.group(1).splitlines())
+    codes = [int(v, 16) for v in re.findall(r'0x[0-9A-Fa-f]{2}', body)]
+    if len(codes) != 96:
+        raise SystemExit('%s: ASCII2printwheel[] has %d entries' % (path, len(codes)))
+    return codes
+
+
+def reverse(codes):
+    """printwheel code 0-96 to ASCII, 0 where a key produces nothing"""
+    table = [0]*97
+    for i, code in enumerate(codes):
+        if not code or code in KEYCAPS:     # space and DEL have no printwheel code
+            continue
+        if table[code]:
+            raise SystemExit('printwheel code 0x%02X is both %r and %r' % (code, chr(table[code]), chr(i+0x20)))
+        table[code] = i+0x20
+    for code, c in KEYCAPS.items():
+        table[code] = ord(c) if c else 0
+    return table
+
+
+def label(c):
+    return '' if not c else chr(c)
+
+
+def render(table, code, eol):
+    lines = ['char %s printwheel2ASCII[97] = {' % code]
+    for row in range(0, 97, 16):
+        values = table[row:row+16]
+        lines.append(('//   ' + ''.join('%5s' % label(c) for c in values)).rstrip())
+        data = '       ' + ','.join('0x%02X' % c for c in values)
+        last = row+16 >= 97
+        lines.append(data + ('}; ' if last else ',  ') + '// %02X' % row)
+    return eol.join(lines)
+
+
+def main(argv):
+    check = '--check' in argv[1:]
+    stale = 0
+    for tree in TREES:
+        path = os.path.join(HERE, '..', tree, 'wheelwriter.c')
+        with open(path, 'rb') as f:
+            text = f.read().decode('latin-1')
+        m = REVERSE.search(text)
+        if not m:
+            raise SystemExit('%s: no printwheel2ASCII[]' % path)
+        eol = '\r\n' if '\r\n' in text else '\n'
+        new = render(reverse(forward(text, path)), m.group(1), eol)
+        if m.group(0) == new:
+            continue
+        stale += 1
+        if check:
+            print('%s: printwheel2ASCII[] is out of date' % os.path.normpath(path))
+        else:
+            with open(path, 'wb') as f:
+                f.write((text[:m.start()] + new + text[m.end():]).encode('latin-1'))
+            print('%s: printwheel2ASCII[] rewritten' % os.path.normpath(path))
+    return 1 if check and stale else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))